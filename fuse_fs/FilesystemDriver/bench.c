@@ -0,0 +1,294 @@
+#include "simpleFS.h"
+#include "helper.h"
+#include <getopt.h>
+#include <fcntl.h>
+
+/*
+ * bench_simpleFS [-n ops] [-s file_size] [-d depth] [-b blocks] [-i inodes] [-C | -D]
+ *                [-o results] [-c baseline [-t percent]] [bench ...]
+ *
+ * Microbenchmarks of the simpleFS library calls against a temporary image of the given
+ * geometry. Every operation runs in a directory depth levels below the root and is undone
+ * (untimed) before the next one, so the image looks the same to each of the ops runs.
+ *
+ * Results are written one JSON object per line: ops per second, the median and 99th
+ * percentile latency, the read and write system calls per op (from /proc/self/io;
+ * seeks aren't counted) and the image bytes read and written and seeks per op (from the
+ * library's counters). For calls that read or write file data, amplification is the image
+ * bytes moved per byte of the file. With -c they are compared with a results file written
+ * before, and the exit status is 1 if a benchmark lost more than percent (default 10) of
+ * its ops/sec.
+ */
+
+#define DEFAULT_OPS    2000
+#define DEFAULT_BLOCKS 1024
+#define DEFAULT_INODES 256
+#define MAX_BENCH      16
+#define PATH_LEN       256
+
+struct bench {
+  const char *name;
+  int (*prepare)();      /* once before the runs */
+  int (*setup)();        /* before each run, untimed */
+  int (*op)();           /* the timed call */
+  int (*teardown)();     /* after each run, untimed */
+  int data;              /* the call reads or writes file_size bytes of file data */
+};
+
+struct result {
+  char   name[32];
+  double ops_per_sec;
+  long   p50_ns, p99_ns;
+  double syscalls;
+  double bytes_read, bytes_written, seeks;   /* image I/O per op */
+  double amplification;                      /* 0 for calls without file data */
+};
+
+static char base[PATH_LEN - 8], target[PATH_LEN], other[PATH_LEN];
+static char *data;
+static int  file_size = BLOCK_SIZE;
+
+static void usage(char *prog)
+{
+  printf("usage: %s [-n ops] [-s file_size] [-d depth] [-b blocks] [-i inodes] [-C | -D]\n"
+         "       [-o results] [-c baseline [-t percent]] [bench ...]\n", prog);
+  exit(1);
+}
+
+/**
+ * Read and write system calls made by this process so far, or -1 without /proc/self/io
+ */
+static long long io_syscalls()
+{
+  char buf[512];
+  int fd = open("/proc/self/io", O_RDONLY);
+  if (fd < 0) return -1;
+
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) return -1;
+  buf[len] = '\0';
+
+  char *r = strstr(buf, "syscr:"), *w = strstr(buf, "syscw:");
+  if (r == NULL || w == NULL) return -1;
+
+  return atoll(r + 6) + atoll(w + 6);
+}
+
+static long long elapsed_ns(struct timespec *a, struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return (x > y) - (x < y);
+}
+
+// the operations: target is base/bench, other is base/other
+static int op_mkdir()       { return make_directory(target, strlen(target)); }
+static int op_rmdir()       { return rm_directory(target, strlen(target)); }
+static int op_create()      { return create_file(target, strlen(target), file_size, data); }
+static int op_rm()          { return rm_file(target, strlen(target)); }
+static int op_read()        { return read_file(other, strlen(other), data) == file_size ? 0 : -EIO; }
+static int op_link()        { return make_link(target, strlen(target), other); }
+static int create_other()   { return create_file(other, strlen(other), file_size, data); }
+static int rm_other()       { return rm_file(other, strlen(other)); }
+
+static int op_lookup()
+{
+  char path[PATH_LEN];
+  strcpy(path, other);
+  return (validate_path(path, 1) < 0) ? -ENOENT : 0;
+}
+
+static struct bench benches[] = {
+  { "make_directory", NULL,         NULL,      op_mkdir,  op_rmdir },
+  { "rm_directory",   NULL,         op_mkdir,  op_rmdir,  NULL     },
+  { "create_file",    NULL,         NULL,      op_create, op_rm,   1 },
+  { "rm_file",        NULL,         op_create, op_rm,     NULL     },
+  { "read_file",      create_other, NULL,      op_read,   NULL,    1 },
+  { "make_link",      create_other, NULL,      op_link,   op_rm    },
+  { "validate_path",  create_other, NULL,      op_lookup, NULL     },
+};
+
+#define N_BENCH (int) (sizeof(benches) / sizeof(benches[0]))
+
+/**
+ * Run one benchmark ops times. Returns 0, or the first error of one of its calls
+ */
+static int run_bench(struct bench *b, int ops, struct result *res)
+{
+  long long *ns = malloc(sizeof(long long) * ops), total = 0, calls = 0;
+  uint64_t bytes_read = 0, bytes_written = 0, seeks = 0;
+  if (ns == NULL) return -ENOMEM;
+
+  // what sampling the counters costs by itself
+  long long c0 = io_syscalls(), cost = io_syscalls() - c0;
+  int i, result = (b->prepare != NULL) ? b->prepare() : 0;
+
+  for (i = 0; i < ops && result >= 0; i++) {
+    if (b->setup != NULL && (result = b->setup()) < 0) break;
+
+    struct timespec t0, t1;
+    long long before = io_syscalls();
+    struct fs_counters io = counters;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    result = b->op();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    calls += io_syscalls() - before - cost;
+    bytes_read    += counters.bytes_read - io.bytes_read;
+    bytes_written += counters.bytes_written - io.bytes_written;
+    seeks         += counters.seeks - io.seeks;
+
+    ns[i]  = elapsed_ns(&t0, &t1);
+    total += ns[i];
+    if (result >= 0 && b->teardown != NULL) result = b->teardown();
+  }
+  if (b->prepare != NULL) rm_other();
+
+  if (result >= 0) {
+    qsort(ns, ops, sizeof(long long), cmp_ns);
+    snprintf(res->name, sizeof(res->name), "%s", b->name);
+    res->ops_per_sec = (total > 0) ? ops * 1e9 / total : 0;
+    res->p50_ns      = ns[ops / 2];
+    res->p99_ns      = ns[(ops * 99LL) / 100 < ops ? (ops * 99LL) / 100 : ops - 1];
+    res->syscalls    = (c0 < 0) ? -1 : (double) calls / ops;
+    res->bytes_read    = (double) bytes_read / ops;
+    res->bytes_written = (double) bytes_written / ops;
+    res->seeks         = (double) seeks / ops;
+    res->amplification = (b->data && file_size > 0) ? (res->bytes_read + res->bytes_written) / file_size : 0;
+  }
+
+  free(ns);
+  return (result < 0) ? result : 0;
+}
+
+/**
+ * Load the results of an earlier run. Returns how many there were
+ */
+static int load_results(char *path, struct result *res, int max)
+{
+  FILE *in = fopen(path, "r");
+  char line[512];
+  int count = 0;
+
+  if (in == NULL) return 0;
+  while (count < max && fgets(line, sizeof(line), in) != NULL) {
+    struct result *r = &res[count];
+    if (sscanf(line, "{\"bench\":\"%31[^\"]\",\"ops_per_sec\":%lf,\"p50_ns\":%ld,\"p99_ns\":%ld,\"syscalls_per_op\":%lf",
+               r->name, &r->ops_per_sec, &r->p50_ns, &r->p99_ns, &r->syscalls) == 5) count++;
+  }
+  fclose(in);
+
+  return count;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int blocks = DEFAULT_BLOCKS, inodes = DEFAULT_INODES;
+  int ops = DEFAULT_OPS, depth = 1, features = SB_METADATA_CSUM, opt;
+  char *out_path = NULL, *baseline = NULL;
+  double threshold = 10;
+
+  while ((opt = getopt(argc, argv, "n:s:d:b:i:CDo:c:t:")) != -1) {
+    switch (opt) {
+    case 'n': ops       = atoi(optarg);                 break;
+    case 's': file_size = atoi(optarg);                 break;
+    case 'd': depth     = atoi(optarg);                 break;
+    case 'b': blocks    = strtoul(optarg, NULL, 10);    break;
+    case 'i': inodes    = strtoul(optarg, NULL, 10);    break;
+    case 'C': features  = 0;                            break;
+    case 'D': features  = SB_METADATA_CSUM | SB_DATA_CSUM; break;
+    case 'o': out_path  = optarg;                       break;
+    case 'c': baseline  = optarg;                       break;
+    case 't': threshold = atof(optarg);                 break;
+    default : usage(argv[0]);
+    }
+  }
+  if (ops <= 0 || depth < 0 || depth > 32 || file_size < 0 || file_size > DIRECT_BLOCKS * BLOCK_SIZE) usage(argv[0]);
+
+  // 1. a fresh image with the bench directory depth levels down
+  char image[] = "/tmp/simpleFS_bench_XXXXXX";
+  int fd = mkstemp(image);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  int result = format_filesystem(image, strlen(image), blocks, inodes, 0, features);
+  if (result < 0) {
+    printf("Could not create %s - %s\n", image, strerror(-result));
+    unlink(image);
+    return 1;
+  }
+  fclose(fp);
+  open_filesystem(image, strlen(image));
+
+  int i, j;
+  base[0] = '\0';
+  for (i = 0; i < depth; i++) {
+    strcat(base, "/d");
+    make_directory(base, strlen(base));
+  }
+  snprintf(target, sizeof(target), "%s/bench", base);
+  snprintf(other, sizeof(other), "%s/other", base);
+
+  data = malloc(DIRECT_BLOCKS * BLOCK_SIZE);
+  for (i = 0; i < DIRECT_BLOCKS * BLOCK_SIZE; i++) data[i] = 'a' + i % 26;
+
+  // 2. run the benchmarks asked for, or all of them
+  struct result results[MAX_BENCH], before[MAX_BENCH];
+  int count = 0, nbefore = (baseline != NULL) ? load_results(baseline, before, MAX_BENCH) : 0;
+  if (baseline != NULL && nbefore == 0) fprintf(stderr, "No results in baseline %s\n", baseline);
+
+  for (i = 0; i < N_BENCH; i++) {
+    for (j = optind; j < argc && strcmp(argv[j], benches[i].name) != 0; j++);
+    if (optind < argc && j == argc) continue;
+
+    result = run_bench(&benches[i], ops, &results[count]);
+    if (result < 0) {
+      fprintf(stderr, "%s failed - %s\n", benches[i].name, strerror(-result));
+      continue;
+    }
+    count++;
+  }
+
+  fclose(fp);
+  unlink(image);
+
+  // 3. write the results, then compare them
+  FILE *out = (out_path != NULL) ? fopen(out_path, "w") : stdout;
+  if (out == NULL) {
+    perror(out_path);
+    return 1;
+  }
+
+  for (i = 0; i < count; i++) {
+    fprintf(out, "{\"bench\":\"%s\",\"ops_per_sec\":%.1f,\"p50_ns\":%ld,\"p99_ns\":%ld,\"syscalls_per_op\":%.2f,"
+            "\"bytes_read_per_op\":%.1f,\"bytes_written_per_op\":%.1f,\"seeks_per_op\":%.2f,\"amplification\":%.2f,"
+            "\"ops\":%d,\"file_size\":%d,\"depth\":%d,\"blocks\":%u,\"inodes\":%u,\"features\":%d}\n",
+            results[i].name, results[i].ops_per_sec, results[i].p50_ns, results[i].p99_ns, results[i].syscalls,
+            results[i].bytes_read, results[i].bytes_written, results[i].seeks, results[i].amplification,
+            ops, file_size, depth, blocks, inodes, features);
+  }
+  if (out != stdout) fclose(out);
+
+  int regressed = 0;
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < nbefore && strcmp(before[j].name, results[i].name) != 0; j++);
+    if (j == nbefore || before[j].ops_per_sec <= 0) continue;
+
+    double change = (results[i].ops_per_sec / before[j].ops_per_sec - 1) * 100;
+    int worse     = change < -threshold;
+    fprintf(stderr, "%-16s %12.1f ops/s (%+6.1f%%)  p50 %8ld ns (was %ld)  syscalls/op %.2f (was %.2f)%s\n",
+            results[i].name, results[i].ops_per_sec, change, results[i].p50_ns, before[j].p50_ns,
+            results[i].syscalls, before[j].syscalls, worse ? "  REGRESSION" : "");
+    regressed |= worse;
+  }
+
+  free(data);
+  return regressed;
+}
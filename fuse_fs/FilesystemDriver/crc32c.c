@@ -0,0 +1,96 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_mode = 0; /* 0 not chosen yet, 1 table, 2 SSE4.2 */
+
+/**
+ * Build the slice-by-8 tables: table[k][b] is the crc of byte b followed by k zero bytes
+ */
+static void crc32c_init_table()
+{
+  uint32_t crc;
+  int b, k, bit;
+
+  for (b = 0; b < 256; b++) {
+    crc = b;
+    for (bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    crc32c_table[0][b] = crc;
+  }
+  for (b = 0; b < 256; b++) {
+    for (k = 1; k < 8; k++) crc32c_table[k][b] = (crc32c_table[k - 1][b] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][b] & 0xff];
+  }
+}
+
+/**
+ * Table driven CRC32C, eight bytes per step
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t n)
+{
+  uint64_t word;
+
+  for (; n > 0 && ((uintptr_t) p & 7) != 0; n--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+  for (; n >= 8; n -= 8, p += 8) {
+    memcpy(&word, p, sizeof(word));
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff]         ^ crc32c_table[6][(word >> 8) & 0xff]  ^
+          crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+  }
+
+  for (; n > 0; n--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+  return crc;
+}
+
+#ifdef CRC32C_SSE42
+/**
+ * CRC32C with the SSE4.2 crc32 instruction. A block is at most a few hundred bytes, where a
+ * single dependency chain of 8 byte steps is already memory bound, so it isn't split in streams
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+  uint64_t c = crc, word;
+
+  for (; n > 0 && ((uintptr_t) p & 7) != 0; n--) c = _mm_crc32_u8(c, *p++);
+
+  for (; n >= 8; n -= 8, p += 8) {
+    memcpy(&word, p, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+  }
+
+  for (; n > 0; n--) c = _mm_crc32_u8(c, *p++);
+
+  return c;
+}
+#endif
+
+/**
+ * CRC32C of n bytes of data, continuing from crc. The implementation is picked on first use
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t n)
+{
+  if (crc32c_mode == 0) {
+    crc32c_init_table();
+    crc32c_mode = 1;
+#ifdef CRC32C_SSE42
+    if (__builtin_cpu_supports("sse4.2")) crc32c_mode = 2;
+#endif
+  }
+
+  crc = ~crc;
+#ifdef CRC32C_SSE42
+  if (crc32c_mode == 2) return ~crc32c_hw(crc, data, n);
+#endif
+  return ~crc32c_sw(crc, data, n);
+}
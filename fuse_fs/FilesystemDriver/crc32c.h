@@ -0,0 +1,11 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli, polynomial 0x1EDC6F41 reflected as 0x82F63B78), the checksum used
+ * for the superblock, bitmaps, inodes and blocks of the image. On x86-64 CPUs with SSE4.2
+ * the crc32 instruction does the work; elsewhere a slice-by-8 table.
+ */
+
+// Continue the CRC32C crc of earlier bytes over n bytes of data. Start with crc 0
+uint32_t crc32c(uint32_t crc, const void *data, size_t n);
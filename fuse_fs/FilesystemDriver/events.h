@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Rings of recent internal events, for finding out what happened around a latency spike.
+ *
+ * Each thread records into a ring of its own of EVENT_RING_SIZE events, overwriting the
+ * oldest, without locks or atomic read-modify-writes: only the owner writes a ring, and it
+ * publishes an event by storing the ring's head after it. Readers copy a ring while it may
+ * be written and keep only the events the head says weren't overwritten meanwhile. Nothing
+ * is formatted until the rings are dumped, so an event costs a clock read and a few stores.
+ *
+ * A thread takes a free ring the first time it records and gives it back with
+ * event_thread_exit; a ring handed to another thread starts with an EV_THREAD event.
+ * Threads beyond EVENT_RINGS at once record nothing.
+ */
+#define EVENT_RINGS     64
+#define EVENT_RING_SIZE 1024 /* a power of two */
+
+enum event_type {
+    EV_NONE,
+    EV_THREAD,            /* a: the thread id that took the ring */
+    EV_OP,                /* an operation finished. a: what kind (the caller's numbering), b: ns it took, c: image bytes it moved */
+    EV_INODE_CSUM_MISS,   /* an inode's checksum wasn't checked yet and was read. a: the inode */
+    EV_BLOCK_CSUM_MISS,   /* a block's checksum wasn't checked yet and was read. a: the block */
+    EV_ALLOC_INODE,       /* a: bitmap bytes scanned, b: the inode taken (or -1) */
+    EV_ALLOC_BLOCK,       /* a: bitmap bytes scanned, b: the block taken (or -1) */
+    EV_ALLOC_RUN,         /* a: blocks scanned, b: the first block taken (or -1), c: blocks asked for */
+    EV_FLUSH,             /* the image's stdio buffer was written out. a: bytes, b: ns it took */
+    EV_TYPES
+};
+
+struct event {
+    uint64_t time;        /* CLOCK_MONOTONIC, in ns */
+    uint32_t type;        /* enum event_type */
+    uint32_t a, b, c;
+};
+
+// Record an event in the calling thread's ring
+void event(uint32_t type, uint32_t a, uint32_t b, uint32_t c);
+
+// Give the calling thread's ring back, when the thread exits
+void event_thread_exit(void);
+
+// Name the kinds of operation of EV_OP events in dumps
+void event_op_names(const char *const *names, int n);
+
+// Call out with each line of a dump of the rings, oldest event first per ring. Only
+// async-signal-safe calls are made, so it can run in a signal handler if out can
+void event_dump(void (*out)(const char *line, size_t len, void *arg), void *arg);
@@ -8,28 +8,85 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <stddef.h>
 
 int          my_create(char *path, unsigned int n, int size, char *data, int type);
 unsigned int my_read(char *path, unsigned int n, char *data, int type);
 int          my_remove(char *path, unsigned int n, int type);
+int          remove_tree(char *path, unsigned int n, int snapshot);
 
 void init_inode(struct inode *node, int type, int size, int index);
+int  file_slots(struct inode *node);
+void update_eof_flag(struct inode *node);
+uint32_t small_capacity(struct inode *node);
+uint64_t tail_addr(struct inode *node);
+int  tail_alloc(uint32_t len, uint32_t *block, uint32_t *off);
+int  tail_free(uint32_t block, uint32_t off, uint32_t len);
+int  pack_tail(struct inode *node, uint32_t size);
+int  unpack_small(struct inode *node);
+int  cluster_compressed(struct inode *node, int c);
+int  read_cluster(struct inode *node, int c, char *buf);
+int  write_cluster(struct inode *node, int c, char *buf, int len, int compress);
+int  expand_cluster(struct inode *node, int c);
+void update_compressed_flag(struct inode *node);
+int  is_zero(const char *data, int n);
 void init_direntry(struct directory_entry *dirent, uint32_t current_inode, uint32_t parent_index);
 
 char *create_path(char *path, unsigned int n);
 int   validate_path(char *npath, int type);
 int   check_permissions(uint16_t mode, uint16_t mask);
+int   check_rw_access(struct inode *node);
+int   check_r_access(struct inode *node);
+int   check_w_access(struct inode *node);
+int   dirent_is_type(uint16_t file_type, int type);
+uint32_t dirent_cookie(struct directory_entry *dirent);
   
 void update_superblock(int add, int num_data_blocks);
+void write_superblock();
 void update_bitmaps();
 
+void csum_reset();
+int  csum_failed();
+void csum_inode(struct inode *node, uint32_t index);
+int  verify_inode(struct inode *node, uint32_t index);
+void csum_block(const char *data, uint32_t block);
+void csum_refresh(uint32_t block);
+int  verify_block(const char *data, uint32_t block);
+int  check_block(uint32_t block);
+
+void         image_access(uint64_t pos, uint64_t len);
+void         image_seek(uint64_t pos);
+size_t       image_read(void *data, size_t size, size_t n);
+size_t       image_write(const void *data, size_t size, size_t n);
+void         image_flush();
+
 void         read_inode(struct inode *node, uint32_t index);
+void         read_inodes(struct inode *nodes, uint32_t *index, int n);
+uint64_t     prefetch_inodes(uint32_t *index, int n);
 void         read_direntry(struct directory_entry *entries, uint32_t index, int n);
 unsigned int read_data(char *data, uint32_t index, int n);
+int          map_extents(struct inode *node, uint32_t index, size_t size, off_t offset, struct extent *ext, int max);
 
 void write_inode(struct inode *node, uint32_t index);
+void init_itable(uint32_t block);
 void write_direntry(struct directory_entry *entries, uint32_t index, int n);
 void write_data(char *data, int index, int n);
+int  zero_range(struct inode *node, uint32_t from, uint32_t to);
 
 int  get_inode();
-int  get_datablock(int index);
\ No newline at end of file
+int  get_datablock(int index);
+int  alloc_datablock();
+int  alloc_run(uint32_t *blocks, int count);
+int  release_blocks(struct inode *node);
+int  block_shared(uint32_t block);
+void write_refcount(uint32_t block);
+int  free_block(uint32_t block);
+int  unshare_block(struct inode *node, int i, int copy);
+int  init_refcounts();
+int  snapshot_file(uint32_t index, uint32_t copy);
+
+uint32_t block_hash(const char *data);
+void dedup_forget(uint32_t block);
+void dedup_reset();
+void dedup_build();
+int  dedup_block(struct inode *node, int i);
\ No newline at end of file
@@ -0,0 +1,162 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+int log_level = LVL_WARN;
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  log_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t log_thread;
+static FILE *log_fp;
+static int log_running;
+
+struct log_entry {
+  struct timespec time;
+  int level;
+  uint32_t suppressed;  /* messages of the site left out before this one */
+  char msg[LOG_LINE];
+};
+
+// the queue; head is the next entry to write, tail the next free one
+static struct log_entry queue[LOG_QUEUE];
+static unsigned int head, tail, dropped;
+static unsigned int unreported; /* messages left out and not yet counted in a message */
+
+/**
+ * Start a line of the log with the time and level of its message
+ */
+static void log_prefix(FILE *out, const struct timespec *time, int level)
+{
+  struct tm tm;
+
+  localtime_r(&time->tv_sec, &tm);
+  fprintf(out, "%02d:%02d:%02d.%03ld simpleFS %s: ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+          time->tv_nsec / 1000000, level_names[level]);
+}
+
+/**
+ * Write the queued messages until log_stop, without holding the lock while writing
+ */
+static void *log_writer(void *arg)
+{
+  struct log_entry e;
+
+  pthread_mutex_lock(&log_mutex);
+  for (;;) {
+    while (head == tail && dropped == 0 && log_running) pthread_cond_wait(&log_ready, &log_mutex);
+    if (head == tail && dropped == 0) break;
+
+    unsigned int lost = 0;
+    if (head != tail) e = queue[head++ % LOG_QUEUE];
+    else {
+      lost    = dropped;
+      dropped = 0;
+    }
+    int last = (head == tail);
+    pthread_mutex_unlock(&log_mutex);
+
+    if (lost > 0) fprintf(log_fp, "simpleFS: %u messages dropped, the log queue was full\n", lost);
+    else {
+      log_prefix(log_fp, &e.time, e.level);
+      fputs(e.msg, log_fp);
+      if (e.suppressed > 0) fprintf(log_fp, " (and %u more like it)", e.suppressed);
+      fputc('\n', log_fp);
+    }
+    if (last) fflush(log_fp);
+    pthread_mutex_lock(&log_mutex);
+  }
+  pthread_mutex_unlock(&log_mutex);
+
+  fflush(log_fp);
+  return NULL;
+}
+
+void log_write(struct log_site *site, int level, const char *fmt, ...)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  pthread_mutex_lock(&log_mutex);
+  if (site->second != (uint64_t) now.tv_sec) {
+    site->second = now.tv_sec;
+    site->count  = 0;
+  }
+  if (site->count++ >= LOG_BURST) {
+    site->suppressed++;
+    unreported++;
+    pthread_mutex_unlock(&log_mutex);
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+
+  if (!log_running) {
+    log_prefix(stderr, &now, level);
+    vfprintf(stderr, fmt, args);
+    if (site->suppressed > 0) fprintf(stderr, " (and %u more like it)", site->suppressed);
+    fputc('\n', stderr);
+  }
+  else if (tail - head == LOG_QUEUE) dropped++;
+  else {
+    struct log_entry *e = &queue[tail++ % LOG_QUEUE];
+    e->time       = now;
+    e->level      = level;
+    e->suppressed = site->suppressed;
+    vsnprintf(e->msg, LOG_LINE, fmt, args);
+    pthread_cond_signal(&log_ready);
+  }
+
+  va_end(args);
+  unreported      -= site->suppressed;
+  site->suppressed = 0;
+  pthread_mutex_unlock(&log_mutex);
+}
+
+int log_start(const char *path)
+{
+  if (log_running) return 0;
+
+  log_fp = (path != NULL) ? fopen(path, "a") : stderr;
+  if (log_fp == NULL) return -errno;
+
+  log_running = 1;
+  int result  = pthread_create(&log_thread, NULL, log_writer, NULL);
+  if (result != 0) {
+    log_running = 0;
+    if (log_fp != stderr) fclose(log_fp);
+    return -result;
+  }
+
+  return 0;
+}
+
+void log_stop()
+{
+  pthread_mutex_lock(&log_mutex);
+  int running = log_running;
+  log_running = 0;
+  pthread_cond_signal(&log_ready);
+  pthread_mutex_unlock(&log_mutex);
+  if (!running) return;
+
+  pthread_join(log_thread, NULL);
+  if (unreported > 0) fprintf(log_fp, "simpleFS: %u more messages were left out by the rate limit\n", unreported);
+  if (log_fp != stderr) fclose(log_fp);
+}
+
+int log_parse_level(const char *name)
+{
+  int level;
+
+  for (level = LVL_ERROR; level <= LVL_DEBUG; level++) {
+    if (strcmp(name, level_names[level]) == 0) return level;
+  }
+  return -1;
+}
@@ -0,0 +1,53 @@
+#include <stdint.h>
+
+/*
+ * The library's diagnostics. log_msg(level, fmt, ...) formats a message only if level is
+ * at most both LOG_COMPILED (messages above it are compiled out) and log_level (set at run
+ * time), so a message that is switched off costs a compare.
+ *
+ * Each call site may log LOG_BURST messages per second; past that its messages are counted
+ * and the count is reported with the site's next message. Until log_start is called,
+ * messages are written to stderr as they come, which suits the command line tools. After
+ * it, they are queued with their time and level and a thread of their own writes them, so
+ * the caller never waits for the console; when the queue is full they are dropped and
+ * counted instead.
+ */
+enum log_level {
+    LVL_ERROR,            /* the image is damaged or can't be used */
+    LVL_WARN,             /* an operation failed for want of space or memory */
+    LVL_INFO,
+    LVL_DEBUG             /* an operation was refused: bad paths, permissions and the like */
+};
+
+#ifndef LOG_COMPILED
+#define LOG_COMPILED LVL_DEBUG
+#endif
+
+#define LOG_BURST 10
+#define LOG_QUEUE 256  /* messages waiting for the writer */
+#define LOG_LINE  256  /* longest message written */
+
+struct log_site {
+    uint64_t second;      /* the second the count is for */
+    uint32_t count;       /* messages logged in it */
+    uint32_t suppressed;  /* messages not logged since the last one that was */
+};
+
+extern int log_level;
+
+#define log_msg(level, ...) do {                                                          \
+    static struct log_site log_site_;                                                      \
+    if ((level) <= LOG_COMPILED && (level) <= log_level) log_write(&log_site_, level, __VA_ARGS__); \
+  } while (0)
+
+void log_write(struct log_site *site, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+// Write messages from a thread of their own from now on, appended to path (stderr if NULL).
+// Returns 0 or -errno
+int log_start(const char *path);
+
+// Write what is queued and stop the thread
+void log_stop(void);
+
+// The level called name ("error", "warn", "info" or "debug"), or -1
+int log_parse_level(const char *name);
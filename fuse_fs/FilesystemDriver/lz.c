@@ -0,0 +1,165 @@
+#include "lz.h"
+
+/**
+ * Load 4 bytes for hashing and comparing, wherever they are aligned
+ */
+static uint32_t lz_read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+
+  return v;
+}
+
+/**
+ * Hash 4 bytes into the match table (Knuth's multiplicative hash)
+ */
+static int lz_hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write the continuation bytes of a length that didn't fit in its nibble. Returns NULL if out of room
+ */
+static unsigned char *lz_put_length(unsigned char *op, unsigned char *oend, int len)
+{
+  for (; len >= 255; len -= 255) {
+    if (op >= oend) return NULL;
+    *op++ = 255;
+  }
+  if (op >= oend) return NULL;
+  *op++ = len;
+
+  return op;
+}
+
+/**
+ * Write one sequence: lit literals from anchor and, if len > 0, a match of len bytes at offset back
+ */
+static unsigned char *lz_put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *anchor,
+                                      int lit, int offset, int len)
+{
+  if (op >= oend) return NULL;
+
+  unsigned char *token = op++;
+  int ml = (len > 0) ? len - LZ_MIN_MATCH : 0;
+  *token = ((lit < 15) ? lit : 15) << 4 | ((ml < 15) ? ml : 15);
+
+  if (lit >= 15 && (op = lz_put_length(op, oend, lit - 15)) == NULL) return NULL;
+  if (oend - op < lit) return NULL;
+  memcpy(op, anchor, lit);
+  op += lit;
+  if (len == 0) return op;
+
+  if (oend - op < 2) return NULL;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (ml >= 15 && (op = lz_put_length(op, oend, ml - 15)) == NULL) return NULL;
+
+  return op;
+}
+
+/**
+ * Greedy compression: at each position look up the last place the next 4 bytes were seen
+ * and take the match if it is real and within reach of a 16 bit offset
+ */
+int lz_compress(const char *src, int n, char *dst, int cap)
+{
+  const unsigned char *in     = (const unsigned char *) src;
+  const unsigned char *end    = in + n;
+  const unsigned char *ip     = in;
+  const unsigned char *anchor = in;
+  unsigned char *op           = (unsigned char *) dst;
+  unsigned char *oend         = op + cap;
+  int table[1 << LZ_HASH_BITS], i;
+
+  for (i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+
+  while (end - ip >= LZ_MIN_MATCH) {
+    uint32_t seq = lz_read32(ip);
+    int h        = lz_hash(seq);
+    int cand     = table[h];
+    table[h]     = ip - in;
+
+    if (cand < 0 || (ip - in) - cand > 65535 || lz_read32(in + cand) != seq) {
+      ip++;
+      continue;
+    }
+
+    const unsigned char *match = in + cand;
+    int len = LZ_MIN_MATCH;
+    while (ip + len < end && ip[len] == match[len]) len++;
+
+    op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - match, len);
+    if (op == NULL) return -1;
+
+    ip    += len;
+    anchor = ip;
+  }
+
+  op = lz_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+  if (op == NULL) return -1;
+
+  return op - (unsigned char *) dst;
+}
+
+/**
+ * Read the continuation bytes of a length. Returns -1 if the input ends first
+ */
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend)
+{
+  int len = 0, b;
+
+  do {
+    if (*ip >= iend) return -1;
+    b    = *(*ip)++;
+    len += b;
+  } while (b == 255);
+
+  return len;
+}
+
+/**
+ * Undo lz_compress, checking every length and offset against the buffers
+ */
+int lz_decompress(const char *src, int n, char *dst, int cap)
+{
+  const unsigned char *ip   = (const unsigned char *) src;
+  const unsigned char *iend = ip + n;
+  unsigned char *op         = (unsigned char *) dst;
+  unsigned char *oend       = op + cap;
+
+  while (ip < iend) {
+    int token = *ip++;
+    int lit   = token >> 4, len = token & 15, more;
+
+    if (lit == 15) {
+      if ((more = lz_get_length(&ip, iend)) < 0) return -1;
+      lit += more;
+    }
+    if (iend - ip < lit || oend - op < lit) return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op - (unsigned char *) dst) return -1;
+
+    if (len == 15) {
+      if ((more = lz_get_length(&ip, iend)) < 0) return -1;
+      len += more;
+    }
+    len += LZ_MIN_MATCH;
+    if (oend - op < len) return -1;
+
+    // the match may overlap what it produces, so copy a byte at a time
+    const unsigned char *match = op - offset;
+    while (len-- > 0) *op++ = *match++;
+  }
+
+  return op - (unsigned char *) dst;
+}
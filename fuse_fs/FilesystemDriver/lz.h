@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A small LZ77 codec in the style of LZ4, used to compress file clusters.
+ *
+ * The output is a list of sequences. Each starts with a token byte: the high nibble is the
+ * number of literals, the low nibble the match length minus LZ_MIN_MATCH. A nibble of 15 is
+ * continued by bytes that are added to it, up to and including the first one below 255.
+ * Then come the literals, a two byte little endian offset back into the output and the match
+ * length continuation bytes. The last sequence has literals only.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+// Compress n bytes of src into dst. Returns the compressed size, or -1 if it is more than cap
+int lz_compress(const char *src, int n, char *dst, int cap);
+
+// Decompress n bytes of src into dst. Returns the decompressed size, or -1 if src is
+// corrupt or decompresses to more than cap bytes
+int lz_decompress(const char *src, int n, char *dst, int cap);
@@ -1,4 +1,5 @@
 #include "simpleFS.h"
+#include "log.h"
 
 void test_mkdir() {
   printf("CALL 1:\n");
@@ -48,6 +49,43 @@ void test_rmfile() {
   rm_file("/rFile1", strlen("/rFile1"));
 }
 
+// A write that runs out of space after an inline (len <= INLINE_MAX) or tail packed file
+// got a block of its own must leave the file as it was, and the block must come back when
+// the file is deleted
+void test_small_enospc(unsigned int len) {
+  char data[TAIL_MAX], back[TAIL_MAX], fill[DIRECT_BLOCKS * BLOCK_SIZE];
+  struct extent ext[DIRECT_BLOCKS];
+  unsigned int i;
+
+  printf("\n\nSMALL FILE ENOSPC (%u bytes)\n\n", len);
+  format_filesystem("../enospcImage", strlen("../enospcImage"), 20, 32, 0, 0);
+  open_filesystem("../enospcImage", strlen("../enospcImage"));
+
+  // another file keeps the tail block in use when the file leaves it
+  for (i = 0; i < len; i++) data[i] = '0' + i % 10;
+  create_file("/other", strlen("/other"), len, data);
+  create_file("/small", strlen("/small"), len, data);
+
+  // fill the disk up to one free block
+  memset(fill, 'x', sizeof(fill));
+  for (i = 0; sb.s_free_blocks_count > 1 && i < 20; i++) {
+    char name[16];
+    int k = (sb.s_free_blocks_count - 1 < DIRECT_BLOCKS) ? sb.s_free_blocks_count - 1 : DIRECT_BLOCKS;
+    sprintf(name, "/fill%u", i);
+    while (k > 0 && create_file(name, strlen(name), k * BLOCK_SIZE, fill) < 0) k--;
+  }
+  unsigned int free_blocks = sb.s_free_blocks_count;
+
+  int res = write_file_map("/small", strlen("/small"), 10, 3000, ext, DIRECT_BLOCKS);
+  read_file_data("/small", strlen("/small"), back, len, 0);
+  int same = (memcmp(data, back, len) == 0);
+  rm_file("/small", strlen("/small"));
+
+  printf("write = %d, free blocks %u -> %u\n", res, free_blocks, sb.s_free_blocks_count);
+  if (free_blocks == 1 && res == -ENOSPC && same && sb.s_free_blocks_count == free_blocks) printf("PASSED\n");
+  else printf("FAILED\n");
+}
+
 int main(int argc, char **argv)
 {
   /* TODO:
@@ -61,9 +99,14 @@ int main(int argc, char **argv)
   
   //char *data = "et magnis dis parturient montes, nascetur ridiculus mus. Donec quam felis, ultricies nec, pellentesque eu, pretium quis, sem. Nulla consequat massa quis enim. Donec pede justo, fringilla vel, aliquet nec, vulputate eget, arcu. In enim justo, rhoncus ut, imperdiet a, venenatis vitae, justo. Nullam dictum felis eu pede mollis pretium. Integer tincidunt. Cras dapibus. Vivamus elementum semper nisi. Aenean vulputate eleifend tellus. Aenean leo ligula, porttitor eu, consequat vitae, eleifend ac, enim. Aliquam lorem ante, dapibus in, viverra quis, feugiat a, tellus. Phasellus viverra nulla ut metus varius laoreet. Quisque rutrum. Aenean imperdiet. Etiam ultricies nisi vel augue. Curabitur ullamcorper ultricies nisi. Nam eget dui. Etiam rhoncus. Maecenas tempus, tellus eget condimentum rhoncus, sem quam semper libero, sit amet adipiscing sem neque sed ipsum. Nam quam nunc, blandit vel, luctus pulvinar, hendrerit id, lorem. Maecenas nec odio et ante tincidunt tempus. Donec vitae sapien ut libero venenatis faucibus. Nullam quis ante. Etiam sit amet orci eget eros faucibus tincidunt. Duis leo. Sed fringilla mauris sit amet nibh. Donec sodales sagittis magna. Sed consequat, leo eget bibendum sodales, augue velit cursus nunc, quis gravida magna mi a libero. Fusce vulputate eleifend sapien. Vestibulum purus quam, scelerisque ut, mollis sed, nonummy id, metus. Nullam accumsan lorem in dui. Cras ultricies mi eu turpis hendrerit fringilla. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; In ac dui quis mi consectetuer lacinia. Nam pretium turpis et arcu. Duis arcu tortor, suscipit eget, imperdiet nec, imperdiet iaculis, ipsum. Sed aliquam ultrices mauris. Integer ante arcu, accumsan a, consectetuer eget, posuere ut, mauris. Praesent adipiscing. Phasellus ullamcorper ipsum rutrum nunc. Nunc nonummy metus. Vestibulum volutpat pretium libero. Cras id dui. Aenean ut eros et nisl sagittis vestibulum. Nullam nulla eros, ultricies sit amet, nonummy id, imperdiet feugiat, pede. Sed lectus. Donec mollis hendrerit risus. Phasellus nec sem in justo pellentesque facilisis. Etiam imperdiet imperdiet orci. Nunc nec neque. Phasellus leo dolor, tempus non, auctor et, hendrerit quis, nisi. Curabitur ligula sapien, tincidunt non, euismod vitae, posuere imperdiet, leo. Maecenas malesuada. Praesent congue erat at massa. Sed cursus turpis vitae tortor. Donec posuere vulputate arcu. Phasellus accumsan cursus velit. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; Sed aliquam, nisi quis porttitor congue, elit erat euismod orci, ac placerat dolor lectus quis orci. Phasellus consectetuer vestibulum elit. Aenean tellus metus, bibendum sed, posuere ac, mattis non, nunc. Vestibulum fringilla pede sit amet augue. In turpis. Pellentesque posuere. Praesent turpis. Aenean posuere, tortor sed cursus feugiat, nunc augue blandit nunc, eu sollicitudin urna dolor sagittis lacus. Donec elit libero, sodales nec, volutpat a, suscipit non, turpis. Nullam sagittis. Suspendisse pulvinar, augue ac venenatis condimentum, sem libero volutpat nibh, nec pellentesque velit pede quis nunc. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; Fusce id purus. Ut varius tincidunt libero. Phasellus dolor. Maecenas vestibulum mollis diam. Pellentesque ut neque. Pellentesque habitant morbi tristique senectus et netus et malesuada fames ac turpis egestas. In dui magna, posuere eget, vestibulum et, tempor auctor, justo. In ac felis quis tortor malesuada pretium. Pellentesque auctor neque nec urna. Proin sapien ipsum, porta a, auctor quis, euismod ut, mi. Aenean viverra rhoncus pede. Pellentesque habitant morbi tristique senectus et netus et malesuada fames ac turpis egestas. Ut non enim eleifend felis pretium feugiat. Vivamus quis mi. Phasellus a est. Phasellus magna. In hac habitasse platea dictumst. Curabitur at lacus ac velit ornare lobortis.Cura";
 
+  // these tests want to see every refusal
+  log_level = LVL_DEBUG;
+
   //char *data1 = (char *) malloc(strlen(data) + 1);
   //data1 = "/0";
   init_filesystem(20, "../filesystemImage", strlen("../filesystemImage"));
+  test_small_enospc(200);
+  test_small_enospc(20);
   //create_file("/a", strlen("/a"), strlen(data), data);
   //create_file("/a", strlen("/a"), 0, data1);
   //make_directory("/a", strlen("/a"));
@@ -0,0 +1,88 @@
+#include "simpleFS.h"
+#include <getopt.h>
+
+/*
+ * mkfs_simpleFS [-s size] [-b block_size] [-i bytes_per_inode] [-P] [-C | -D] image
+ *
+ * size is the size of the whole image in bytes and may end in K, M or G.
+ * The image is created sparse; -P reserves its space with posix_fallocate instead.
+ * Metadata is checksummed unless -C is given; -D checksums file data as well.
+ */
+
+#define DEFAULT_SIZE  (BLOCK_SIZE * (START_DATA + 20))
+#define DEFAULT_RATIO (BLOCK_SIZE / 2)
+
+static void usage(char *prog)
+{
+  printf("usage: %s [-s size[K|M|G]] [-b block_size] [-i bytes_per_inode] [-P] [-C | -D] image\n", prog);
+  exit(1);
+}
+
+static unsigned long long parse_size(char *arg)
+{
+  char *end;
+  unsigned long long size = strtoull(arg, &end, 10);
+
+  switch (*end) {
+  case 'G': case 'g': size <<= 10;
+  case 'M': case 'm': size <<= 10;
+  case 'K': case 'k': size <<= 10; end++;
+  }
+
+  if (*end != '\0' || size == 0) return 0;
+  return size;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long long size = DEFAULT_SIZE;
+  unsigned long ratio     = DEFAULT_RATIO;
+  unsigned long block     = BLOCK_SIZE;
+  int prealloc = 0, features = SB_METADATA_CSUM, opt;
+
+  while ((opt = getopt(argc, argv, "s:b:i:PCD")) != -1) {
+    switch (opt) {
+    case 's': size     = parse_size(optarg);     break;
+    case 'b': block    = strtoul(optarg, NULL, 10); break;
+    case 'i': ratio    = strtoul(optarg, NULL, 10); break;
+    case 'P': prealloc = 1;                      break;
+    case 'C': features = 0;                      break;
+    case 'D': features = SB_METADATA_CSUM | SB_DATA_CSUM; break;
+    default : usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || size == 0 || ratio == 0) usage(argv[0]);
+
+  if (block != BLOCK_SIZE) {
+    printf("Block size %lu is not supported - this build uses %d\n", block, BLOCK_SIZE);
+    return 1;
+  }
+
+  // split the image into data blocks and one inode table block per INODES_PER_BLOCK inodes
+  unsigned long long blocks = size / BLOCK_SIZE;
+  unsigned long long inodes = size / ratio;
+  if (inodes > BLOCK_SIZE * 8) inodes = BLOCK_SIZE * 8;
+  inodes = (inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+  if (inodes < INODES_PER_BLOCK) inodes = INODES_PER_BLOCK;
+
+  unsigned long long meta = 3 + inodes / INODES_PER_BLOCK;
+  if (blocks <= meta) {
+    printf("Image of %llu bytes is too small\n", size);
+    return 1;
+  }
+  if (blocks - meta > BLOCK_SIZE * 8) {
+    printf("Image of %llu bytes is too large - the block bitmap covers at most %d data blocks (%llu bytes)\n",
+           size, BLOCK_SIZE * 8, (meta + BLOCK_SIZE * 8) * BLOCK_SIZE);
+    return 1;
+  }
+
+  int result = format_filesystem(argv[optind], strlen(argv[optind]), blocks - meta, inodes, prealloc, features);
+  if (result < 0) {
+    printf("Could not create %s - %s\n", argv[optind], strerror(-result));
+    return 1;
+  }
+  fclose(fp);
+
+  printf("%s: %llu data blocks of %d bytes, %llu inodes\n", argv[optind], blocks - meta, BLOCK_SIZE, inodes);
+  return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * USDT probes of provider simplefs, for bpftrace, perf and SystemTap to attach to:
+ *
+ *   bpftrace -l 'usdt:./fusefs:simplefs:*'
+ *   bpftrace -e 'usdt:./fusefs:simplefs:alloc_datablock_return { @scanned = hist(arg1); }'
+ *
+ * A probe is a nop in the code and a note in the ELF file until a tracer enables it, so
+ * they cost nothing otherwise. They are built in when <sys/sdt.h> (systemtap-sdt-dev) is
+ * there and NO_PROBES isn't defined, and compile to nothing when not. Arguments:
+ *
+ *   validate_path_entry    path, target type      validate_path_return    inode or -errno
+ *   read_inode_entry       inode                  read_inode_return       inode
+ *   write_inode_entry      inode                  write_inode_return      inode
+ *   read_data_entry        block, bytes           read_data_return        bytes read
+ *   write_data_entry       block, bytes           write_data_return       block
+ *   get_inode_entry                               get_inode_return        inode or -1, bitmap bytes scanned
+ *   get_datablock_entry    inode                  get_datablock_return    block or -1
+ *   alloc_datablock_entry                         alloc_datablock_return  block or -1, bitmap bytes scanned
+ *   op_entry               operation, path        op_return               operation, ns, image bytes
+ *
+ * op_entry and op_return are fusefs's handlers; operation is the name the statistics use.
+ */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SFS_PROBES
+#endif
+#endif
+
+#ifdef SFS_PROBES
+#define PROBE(name)                 DTRACE_PROBE(simplefs, name)
+#define PROBE1(name, a)             DTRACE_PROBE1(simplefs, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(simplefs, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(simplefs, name, a, b, c)
+#else
+#define PROBE(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
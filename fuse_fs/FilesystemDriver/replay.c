@@ -0,0 +1,298 @@
+#include "simpleFS.h"
+#include "helper.h"
+#include "trace.h"
+#include <getopt.h>
+
+/*
+ * replay_simpleFS [-v] [-k] trace image
+ *
+ * Runs the operations of a trace written by fusefs -o trace=FILE against image through the
+ * library calls fusefs makes for them, without FUSE or the kernel in the way. The image has
+ * to be a copy of the one the trace started from; it is changed in place unless -k is given,
+ * in which case a temporary copy is replayed instead.
+ *
+ * Each operation is timed and its result compared with the recorded one. Operations are
+ * replayed back to back, in the order they finished, from this one thread. The bytes of
+ * writes aren't in the trace, so a pattern of the same length is written in their place.
+ * Prints the count, mean, median and 99th percentile latency per operation, for the replay
+ * and the recording, and how many results differed (-v lists them)
+ */
+
+#define MAX_PATH 65536
+
+struct op_stats {
+  long long *ns, *recorded;
+  int count, max, mismatches;
+};
+
+static const char *op_names[TRACE_OPS] = {
+  [TRACE_GETATTR] = "getattr",  [TRACE_READDIR] = "readdir",  [TRACE_MKDIR] = "mkdir",
+  [TRACE_RMDIR] = "rmdir",      [TRACE_MKNOD] = "mknod",      [TRACE_UNLINK] = "unlink",
+  [TRACE_RENAME] = "rename",    [TRACE_SYMLINK] = "symlink",  [TRACE_READLINK] = "readlink",
+  [TRACE_READ] = "read",        [TRACE_WRITE] = "write",      [TRACE_TRUNCATE] = "truncate",
+  [TRACE_FALLOCATE] = "fallocate", [TRACE_SEEK] = "seek",     [TRACE_DEDUP] = "dedup",
+  [TRACE_CLONE] = "clone",      [TRACE_IOCTL] = "ioctl",      [TRACE_OPEN] = "open",
+  [TRACE_RELEASE] = "release",
+};
+
+// what writes write, and where reads land
+static char data[DIRECT_BLOCKS * BLOCK_SIZE], scratch[DIRECT_BLOCKS * BLOCK_SIZE];
+
+static void usage(char *prog)
+{
+  printf("usage: %s [-v] [-k] trace image\n", prog);
+  exit(1);
+}
+
+static long long elapsed_ns(struct timespec *a, struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * The name of the snapshot path is, if it names an entry of SNAPSHOT_DIR (as in fusefs)
+ */
+static char *snapshot_name(char *path)
+{
+  size_t len = strlen("/" SNAPSHOT_DIR "/");
+
+  if (strncmp(path, "/" SNAPSHOT_DIR "/", len) != 0 || strchr(path + len, '/') != NULL) return NULL;
+  return path + len;
+}
+
+/**
+ * A write of size bytes at offset, made the way fusefs makes it
+ */
+static int replay_write(char *path, int64_t offset, int64_t size, int flags)
+{
+  int written = 0, n, i;
+
+  if (size > (int64_t) sizeof(data)) size = sizeof(data);
+  if (flags & TRACE_F_COMPRESS) {
+    written = write_file_compressed(path, strlen(path), data, size, offset);
+    if (written < 0) return written;
+  }
+  else {
+    struct extent ext[DIRECT_BLOCKS];
+    n = write_file_map(path, strlen(path), size, offset, ext, DIRECT_BLOCKS);
+    if (n < 0) return n;
+
+    image_flush();
+    for (i = 0; i < n; i++) {
+      ssize_t res = pwrite(fileno(fp), data + written, ext[i].e_len, ext[i].e_pos);
+      if (res < 0) return -errno;
+      written += res;
+    }
+    image_flush();
+    if ((sb.s_flags & SB_METADATA_CSUM) && written > 0) update_file_csums(path, strlen(path), offset, written);
+  }
+
+  if ((flags & TRACE_F_DEDUP) && written > 0) dedup_file(path, strlen(path), offset, written);
+  return written;
+}
+
+/**
+ * Run one operation. Returns what fusefs would have returned for it
+ */
+static int replay_op(struct trace_record *rec, char *path, char *path2, int flags)
+{
+  unsigned int n = strlen(path);
+  char buf[MAX_PATH], *snap;
+  int result;
+
+  switch (rec->op) {
+  case TRACE_GETATTR:
+    strcpy(buf, path);
+    result = validate_path(buf, 3);
+    return (result < 0) ? result : 0;
+  case TRACE_READDIR: {
+    struct directory_entry dirents[MAX_DIRENT];
+    result = list_directory(path, n, dirents);
+    return (result < 0) ? result : 0;
+  }
+  case TRACE_MKDIR:
+    snap   = snapshot_name(path);
+    result = (snap != NULL) ? make_snapshot(snap, strlen(snap)) : make_directory(path, n);
+    return (result < 0) ? result : 0;
+  case TRACE_RMDIR:
+    snap   = snapshot_name(path);
+    result = (snap != NULL) ? delete_snapshot(snap, strlen(snap)) : rm_tree(path, n);
+    return (result < 0) ? result : 0;
+  case TRACE_MKNOD:
+    result = create_file(path, n, 0, NULL);
+    return (result < 0) ? result : 0;
+  case TRACE_UNLINK:
+    result = rm_file(path, n);
+    return (result < 0) ? result : 0;
+  case TRACE_RENAME:
+    result = rename_path(path, n, path2, strlen(path2));
+    return (result < 0) ? result : 0;
+  case TRACE_SYMLINK:
+    result = make_symlink(path, n, path2);
+    return (result < 0) ? result : 0;
+  case TRACE_READLINK:
+    result = read_symlink(path, n, buf, (rec->size < MAX_PATH) ? rec->size : MAX_PATH);
+    return (result < 0) ? result : 0;
+  case TRACE_READ:
+    if ((sb.s_flags & SB_DATA_CSUM) && (result = verify_file_data(path, n, rec->offset, rec->size)) < 0) return result;
+    return read_file_data(path, n, scratch, (rec->size < (int64_t) sizeof(scratch)) ? rec->size : sizeof(scratch), rec->offset);
+  case TRACE_WRITE:
+    return replay_write(path, rec->offset, rec->size, flags);
+  case TRACE_TRUNCATE:
+    result = truncate_file(path, n, rec->size);
+    return (result < 0) ? result : 0;
+  case TRACE_FALLOCATE:
+    result = allocate_file(path, n, rec->arg, rec->offset, rec->size);
+    return (result < 0) ? result : 0;
+  case TRACE_SEEK: {
+    off_t res = seek_file(path, n, rec->offset, rec->size);
+    return (res < 0) ? res : 0;
+  }
+  case TRACE_DEDUP:
+    result = dedup_file(path, n, 0, DIRECT_BLOCKS * BLOCK_SIZE);
+    return (result < 0) ? result : 0;
+  case TRACE_CLONE:
+    if (path2[0] != '/' || rec->offset < 0 || rec->offset2 < 0 || rec->size < 0) return -EINVAL;
+    result = clone_file(path2, strlen(path2), path, n, rec->offset2, rec->offset, rec->size);
+    return (result < 0) ? result : 0;
+  }
+
+  return rec->result;
+}
+
+static void print_stats(const char *name, struct op_stats *s)
+{
+  long long total = 0, recorded = 0;
+  int i, p99 = (s->count * 99LL) / 100;
+
+  for (i = 0; i < s->count; i++) {
+    total    += s->ns[i];
+    recorded += s->recorded[i];
+  }
+  qsort(s->ns, s->count, sizeof(long long), cmp_ns);
+  qsort(s->recorded, s->count, sizeof(long long), cmp_ns);
+
+  printf("%-10s %8d %10lld %10lld %10lld   %10lld %10lld %10lld %8d\n", name, s->count,
+         total / s->count, s->ns[s->count / 2], s->ns[p99],
+         recorded / s->count, s->recorded[s->count / 2], s->recorded[p99], s->mismatches);
+}
+
+int main(int argc, char **argv)
+{
+  int verbose = 0, keep = 0, opt;
+
+  while ((opt = getopt(argc, argv, "vk")) != -1) {
+    switch (opt) {
+    case 'v': verbose = 1; break;
+    case 'k': keep    = 1; break;
+    default : usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) usage(argv[0]);
+
+  FILE *in = fopen(argv[optind], "r");
+  if (in == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  struct trace_header header;
+  if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+    printf("%s is not a trace this version can read\n", argv[optind]);
+    return 1;
+  }
+
+  // 1. the image, or a copy of it
+  char image[] = "/tmp/simpleFS_replay_XXXXXX", *path = argv[optind + 1];
+  if (keep) {
+    FILE *src = fopen(path, "r");
+    int fd = mkstemp(image);
+    if (src == NULL || fd < 0) {
+      perror(src == NULL ? path : "mkstemp");
+      return 1;
+    }
+
+    size_t len;
+    while ((len = fread(data, 1, sizeof(data), src)) > 0) {
+      if (write(fd, data, len) != (ssize_t) len) {
+        perror(image);
+        unlink(image);
+        return 1;
+      }
+    }
+    fclose(src);
+    close(fd);
+    path = image;
+  }
+
+  open_filesystem(path, strlen(path));
+  if (fp == NULL) {
+    if (keep) unlink(image);
+    return 1;
+  }
+
+  int i;
+  for (i = 0; i < (int) sizeof(data); i++) data[i] = 'a' + i % 26;
+
+  // 2. the operations, one at a time
+  struct op_stats stats[TRACE_OPS];
+  memset(stats, 0, sizeof(stats));
+
+  struct trace_record rec;
+  static char path1[MAX_PATH], path2[MAX_PATH];
+  long long ops = 0;
+
+  while (fread(&rec, sizeof(rec), 1, in) == 1) {
+    if (fread(path1, 1, rec.path_len, in) != rec.path_len || fread(path2, 1, rec.path2_len, in) != rec.path2_len) break;
+    path1[rec.path_len]  = '\0';
+    path2[rec.path2_len] = '\0';
+    if (rec.op == 0 || rec.op >= TRACE_OPS) continue;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int result = replay_op(&rec, path1, path2, header.flags);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    struct op_stats *s = &stats[rec.op];
+    if (s->count == s->max) {
+      s->max      = s->max ? s->max * 2 : 256;
+      s->ns       = realloc(s->ns, sizeof(long long) * s->max);
+      s->recorded = realloc(s->recorded, sizeof(long long) * s->max);
+    }
+    s->ns[s->count]       = elapsed_ns(&t0, &t1);
+    s->recorded[s->count] = rec.duration;
+    s->count++;
+    ops++;
+
+    if (result != rec.result) {
+      s->mismatches++;
+      if (verbose) printf("%.3f %s %s%s%s: returned %d, recorded %d\n", rec.time / 1e9, op_names[rec.op],
+                          path1, rec.path2_len ? " " : "", path2, result, rec.result);
+    }
+  }
+  fclose(in);
+  fclose(fp);
+  if (keep) unlink(image);
+
+  // 3. what it took
+  printf("%lld operations\n", ops);
+  printf("%-10s %8s %10s %10s %10s   %10s %10s %10s %8s\n", "op", "count", "mean_ns", "p50_ns", "p99_ns",
+         "rec_mean", "rec_p50", "rec_p99", "differ");
+
+  int mismatches = 0;
+  for (i = 1; i < TRACE_OPS; i++) {
+    if (stats[i].count == 0) continue;
+    print_stats(op_names[i], &stats[i]);
+    mismatches += stats[i].mismatches;
+    free(stats[i].ns);
+    free(stats[i].recorded);
+  }
+
+  return mismatches > 0;
+}
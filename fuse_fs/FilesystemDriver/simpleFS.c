@@ -1,5 +1,14 @@
 #include "simpleFS.h"
 #include "helper.h"
+#include "crc32c.h"
+#include "log.h"
+
+FILE *fp;
+struct superblock sb;
+unsigned char block_bm[BLOCK_SIZE];
+unsigned char inode_bm[BLOCK_SIZE];
+unsigned char block_rc[BLOCK_SIZE * 8];
+struct fs_counters counters;
 
 /**
  *
@@ -17,59 +26,102 @@ void init_filesystem(unsigned int size, char *real_path, unsigned int n)
    * Then have a file system ready.
    * with a parent directory of '/' at inode 2.
    */
+  int result = format_filesystem(real_path, n, size, N_INODES, 0, SB_METADATA_CSUM);
 
   // error check
-  if (size > N_INODES - 2) {
-    printf("Filesystem is too large to initialize\n");
+  if (result == -EFBIG) {
+    log_msg(LVL_ERROR, "Filesystem is too large to initialize");
     exit(1);
-    //return;
   }
-  
+  if (result < 0) {
+    log_msg(LVL_ERROR, "Filesystem could not be initialized - %s", strerror(-result));
+    exit(1);
+  }
+}
+
+/**
+ *
+ */
+int format_filesystem(char *real_path, unsigned int n, unsigned int size, unsigned int inodes, int prealloc, int features)
+{
+  /*
+   * Size the image with ftruncate so the data blocks and the inode table start out
+   * as holes, or reserve them with posix_fallocate. Either way nothing is written per
+   * block, so formatting takes the same time whatever the size.
+   * Then write the superblock, the bitmaps, the root inode and the root directory.
+   * The inode table is marked uninitialized and filled in by write_inode as it is used.
+   * With checksums, the checksum table takes the data blocks right after the root directory.
+   */
+
+  // error check
+  if (size < 1 || size > BLOCK_SIZE * 8) return -EFBIG;
+
+  inodes = (inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+  if (inodes < INODES_PER_BLOCK || inodes > BLOCK_SIZE * 8) return -EINVAL;
+
+  features &= SB_METADATA_CSUM | SB_DATA_CSUM;
+  if (features & SB_DATA_CSUM) features |= SB_METADATA_CSUM;
+  unsigned int csum_blocks = (features) ? ((inodes + size) * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+  if (1 + csum_blocks > size) return -ENOSPC;
+
   // create path and open file
   char *npath = create_path(real_path, n);
-  if (npath == NULL) exit(1); //return;
+  if (npath == NULL) return -ENOMEM;
   fp = fopen(npath, "w+");
+  free(npath);
+  if (fp == NULL) return -errno;
 
-  // initialize super block and write that to disk
-  sb.s_inodes_count      = N_INODES;
+  // initialize super block
+  memset(&sb, 0, sizeof(struct superblock));
+  sb.s_inodes_count      = inodes;
   sb.s_blocks_count      = size;
-  sb.s_free_inodes_count = N_INODES - 3;
-  sb.s_free_blocks_count = size - 1;
-  sb.s_first_data_block  = START_DATA; 
+  sb.s_free_inodes_count = inodes - 3;
+  sb.s_free_blocks_count = size - 1 - csum_blocks;
+  sb.s_first_data_block  = 3 + inodes / INODES_PER_BLOCK;
   sb.s_first_ino         = START_INODE;
   sb.s_magic             = MAGIC_SIGN;
+  sb.s_flags             = SB_ITABLE_UNINIT | features;
+  sb.s_itable_init       = 0;
+  sb.s_tail_block        = 0;
+  sb.s_refcount_block    = 0;
+  sb.s_csum_block        = 1;
 
-  char padding[BLOCK_SIZE] = "";
-  memcpy(padding, &sb, sizeof(struct superblock));
-  fwrite(padding, BLOCK_SIZE, 1, fp);
-    
-  // create bitmaps and write them to the disk image
-  int i;
-  for (i = 0; i < BLOCK_SIZE; i++) block_bm[i] = 0;
-  for (i = 0; i < BLOCK_SIZE; i++) inode_bm[i] = 0;
+  // give the image its full size without writing it
+  off_t bytes = (off_t) BLOCK_SIZE * (sb.s_first_data_block + size);
+  int result  = prealloc ? posix_fallocate(fileno(fp), 0, bytes) : (ftruncate(fileno(fp), bytes) == 0 ? 0 : errno);
+  if (result != 0) {
+    fclose(fp);
+    fp = NULL;
+    return -result;
+  }
+
+  // create bitmaps
+  memset(block_bm, 0, BLOCK_SIZE);
+  memset(inode_bm, 0, BLOCK_SIZE);
+  memset(block_rc, 0, sizeof(block_rc));
   inode_bm[0] = 7;
-  
-  // create 5 block inode table (40 inodes), initialize inode 2 for root directory and write that to disk image 
-  struct inode inodes[N_INODES];
-  init_inode(&inodes[2], 2, sizeof(struct directory_entry) * 2, 2);
-  update_bitmaps();
-  
-  char padding1[BLOCK_SIZE * 5] = "";
-  memcpy(padding1, inodes, sizeof(struct inode) * N_INODES);
-  fwrite(padding1, BLOCK_SIZE * 5, 1, fp);
+  dedup_reset();
+  csum_reset();
+
+  // initialize inode 2 for root directory and its data block and write them to disk image
+  struct inode root;
+  init_inode(&root, 2, sizeof(struct directory_entry) * 2, 2);
+
+  // the checksum table is in the image's holes, so it starts out zero
+  unsigned int i;
+  for (i = 1; i <= csum_blocks; i++) block_bm[i / 8] |= 1 << (i % 8);
+
+  write_inode(&root, 2);
 
-  
-  // initialize and write "size" data blocks to disk image
-  char padding2[BLOCK_SIZE] = "";
   struct directory_entry root_dir[MAX_DIRENT];
   init_direntry(root_dir, 2, 2);
-  memcpy(padding2, root_dir, sizeof(struct directory_entry) * 2);
-  fwrite(padding2, BLOCK_SIZE, 1, fp);
+  write_direntry(root_dir, root.i_block[0], 2);
 
-  for (i = 0; i < BLOCK_SIZE * (size - 1); i++) {
-    char *c = "\0";
-    fwrite(c, 1, 1, fp);
-  }
+  write_superblock();
+  update_bitmaps();
+  image_flush();
+
+  return 0;
 }
 
 /**
@@ -92,24 +144,50 @@ void open_filesystem(char *real_path, unsigned int n)
   // open the file and read the information from the disk and initialize the in-memory variables
   fp = fopen(npath, "r+");
   if (fp == NULL) {
-    printf("Path %s does not exist\n", npath);
+    log_msg(LVL_ERROR, "Path %s does not exist", npath);
     exit(1);
   }
 
   // read super block and fail if magic signature does not match
   char block[BLOCK_SIZE] = "";
-  fread(block, BLOCK_SIZE, 1, fp);
+  image_seek(0);
+  image_read(block, BLOCK_SIZE, 1);
   memcpy(&sb, block, sizeof(struct superblock));
   
   if (sb.s_magic != MAGIC_SIGN) {
-    printf("Wrong filesystem - Magic signature does not match\n");
+    log_msg(LVL_ERROR, "Wrong filesystem - Magic signature does not match");
+    fclose(fp);
+    exit(1);
+  }
+
+  if (sb.s_log_block_size != 0) {
+    log_msg(LVL_ERROR, "Block size %d is not supported - this build uses %d", BLOCK_SIZE << sb.s_log_block_size, BLOCK_SIZE);
     fclose(fp);
     exit(1);
   }
 
   // read the bitmaps
-  fread(block_bm, 1, BLOCK_SIZE, fp);
-  fread(inode_bm, 1, BLOCK_SIZE, fp);
+  image_read(block_bm, 1, BLOCK_SIZE);
+  image_read(inode_bm, 1, BLOCK_SIZE);
+
+  // and fail if they or the superblock don't match their checksums
+  if ((sb.s_flags & SB_METADATA_CSUM) &&
+      (crc32c(0, &sb, offsetof(struct superblock, s_checksum)) != sb.s_checksum ||
+       crc32c(0, block_bm, BLOCK_SIZE) != sb.s_bitmap_csum[0] || crc32c(0, inode_bm, BLOCK_SIZE) != sb.s_bitmap_csum[1])) {
+    log_msg(LVL_ERROR, "Superblock or bitmaps do not match their checksums");
+    fclose(fp);
+    exit(1);
+  }
+  csum_reset();
+  memset(&counters, 0, sizeof(counters));
+
+  // and the block reference counts, if any block was ever shared
+  memset(block_rc, 0, sizeof(block_rc));
+  if (sb.s_refcount_block != 0) {
+    image_seek(START_DATA_ADDR + BLOCK_SIZE * sb.s_refcount_block);
+    image_read(block_rc, 1, sb.s_blocks_count);
+  }
+  dedup_reset();
 }
 
 /**
@@ -118,8 +196,8 @@ void open_filesystem(char *real_path, unsigned int n)
 int my_create(char *path, unsigned int n, int size, char *data, int type)
 {
   // 1. create and validate path
-  if (*(path + n - 1) == '/' && type == 1) {
-    printf("Invalid path - file path cannot end with /\n");
+  if (*(path + n - 1) == '/' && type != 2) {
+    log_msg(LVL_DEBUG, "Invalid path - file path cannot end with /");
     return -ENOENT;
     //exit(1);
   }
@@ -143,25 +221,26 @@ int my_create(char *path, unsigned int n, int size, char *data, int type)
   // 2.0 get the parent inode
   struct inode parent;
   read_inode(&parent, parent_index); 
+  if (parent.i_flags & INODE_SNAPSHOT) return -EROFS;
  
   // check permissions
   if (parent.i_uid == getuid()) {
     if (check_permissions(parent.i_mode, S_IRUSR) == 0 || check_permissions(parent.i_mode, S_IWUSR) == 0) {
-      printf("User does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "User does not have read/write permissions");
       return -EACCES;
       //exit(1);
     }
   }
   else if (parent.i_gid == getgid()) {
     if (check_permissions(parent.i_mode, S_IRGRP) == 0 || check_permissions(parent.i_mode, S_IWGRP) == 0) {
-      printf("Group does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Group does not have read/write permissions");
       return -EACCES;
       //exit(1);   
     }
   }
   else {
     if (check_permissions(parent.i_mode, S_IROTH) == 0 || check_permissions(parent.i_mode, S_IWOTH) == 0) {
-      printf("Other does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Other does not have read/write permissions");
       return -EACCES;
       //exit(1);   
     }
@@ -169,7 +248,7 @@ int my_create(char *path, unsigned int n, int size, char *data, int type)
   
   // if max directories already present, then don't create new
   if (parent.i_size >= sizeof(struct directory_entry) * MAX_DIRENT) {
-    printf("Cannot add more directories to this path\n");
+    log_msg(LVL_DEBUG, "Cannot add more directories to this path");
     return -ENOSPC;
     //exit(1);   
   }
@@ -180,16 +259,29 @@ int my_create(char *path, unsigned int n, int size, char *data, int type)
   read_direntry(dir, parent.i_block[0], MAX_DIRENT);
   for (j = 0; j < entries; j++) {
     if (strcmp(dir[j].d_name, prev + 1) == 0) {
-      printf("Target already exists\n");
+      log_msg(LVL_DEBUG, "Target already exists");
       return -EEXIST;
       //exit(1);   
     }
   }
   
+  // blocks of file data that are all zeros become holes and need no space
+  int i, needed = 0;
+  if (type != 2 && size > DIRECT_BLOCKS * BLOCK_SIZE) return -EFBIG;
+  for (i = 0; type != 2 && data != NULL && size > TAIL_MAX && i * BLOCK_SIZE < size; i++) {
+    int len = (size - i * BLOCK_SIZE < BLOCK_SIZE) ? size - i * BLOCK_SIZE : BLOCK_SIZE;
+    if (is_zero(data + i * BLOCK_SIZE, len) == 0) needed++;
+  }
+  if (type != 2 && data != NULL && size > INLINE_MAX && size <= TAIL_MAX) needed = 1;
+  if (needed > sb.s_free_blocks_count) {
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
   // 3. get index of new inode for new directory
   int index = get_inode();
   if (index == -1) {
-    printf("Disk is full\n");
+    log_msg(LVL_WARN, "Disk is full");
     return -EDQUOT;
     //exit(1);   
   }
@@ -197,9 +289,7 @@ int my_create(char *path, unsigned int n, int size, char *data, int type)
   // 4. make new inode and write that to inode table
   struct inode *child_inode = (struct inode *) malloc(sizeof(struct inode));
   if (type == 2) init_inode(child_inode, 2, sizeof(struct directory_entry) * 2, index);
-  else           init_inode(child_inode, 1, size, index);
-  
-  write_inode(child_inode, index);
+  else           init_inode(child_inode, type, size, index);
     
   // 5. write the data block for new directory/file to disk
   if (type == 2) {
@@ -207,16 +297,30 @@ int my_create(char *path, unsigned int n, int size, char *data, int type)
     init_direntry(new_dir, index, parent_index);
     write_direntry(new_dir, child_inode->i_block[0], 2);
   }
+  else if (data != NULL && size <= INLINE_MAX) {
+    // symlink targets and tiny files live in the inode and need no block
+    memcpy(child_inode->i_block, data, size);
+    child_inode->i_flags |= INODE_INLINE;
+  }
+  else if (data != NULL && size <= TAIL_MAX) {
+    // small files share a tail block with other small files
+    pack_tail(child_inode, size);
+    image_seek(tail_addr(child_inode));
+    image_write(data, 1, size);
+    csum_refresh(child_inode->i_block[0]);
+  }
   else if (data != NULL) {
-    char *temp = create_path(data, size);
-    int i      = 0;
-    for (i = 0; i < child_inode->i_blocks - 1; i++) {
-      write_data(temp, child_inode->i_block[i], BLOCK_SIZE);
-      temp += BLOCK_SIZE;
+    for (i = 0; i * BLOCK_SIZE < size; i++) {
+      int len = (size - i * BLOCK_SIZE < BLOCK_SIZE) ? size - i * BLOCK_SIZE : BLOCK_SIZE;
+      if (is_zero(data + i * BLOCK_SIZE, len)) continue;
+
+      child_inode->i_block[i] = get_datablock(index);
+      child_inode->i_blocks  += 1;
+      write_data(data + i * BLOCK_SIZE, child_inode->i_block[i], len);
     }
-    if (size % BLOCK_SIZE != 0) write_data(temp, child_inode->i_block[i], size % BLOCK_SIZE);
-    else                        write_data(temp, child_inode->i_block[i], size);  
   }
+
+  write_inode(child_inode, index);
   
   // 6. add new directory entry to parent direcrtory's data block and write it back to disk
   dir[entries].d_inode     = index;
@@ -255,7 +359,7 @@ unsigned int my_read(char *path, unsigned int n, char *data, int type)
 {
   // 1. create and validate path
   if (*(path + n - 1) == '/' && type == 1) {
-    printf("Invalid path\n");
+    log_msg(LVL_DEBUG, "Invalid path");
     return -ENOENT;
     //exit(1);   
   }
@@ -276,21 +380,21 @@ unsigned int my_read(char *path, unsigned int n, char *data, int type)
   // check permissions
   if (parent.i_uid == getuid()) {
     if (check_permissions(parent.i_mode, S_IRUSR) == 0) {
-      printf("User does not have read permission\n");
+      log_msg(LVL_DEBUG, "User does not have read permission");
       return -EACCES;;
       //exit(1);   
     }
   }
   else if (parent.i_gid == getgid()) {
     if (check_permissions(parent.i_mode, S_IRGRP) == 0) {
-      printf("Group does not have read permission\n");
+      log_msg(LVL_DEBUG, "Group does not have read permission");
       return -EACCES;;
       //exit(1);   
     }
   }
   else {
     if (check_permissions(parent.i_mode, S_IROTH) == 0) {
-      printf("Other does not have read permission\n");
+      log_msg(LVL_DEBUG, "Other does not have read permission");
       return -EACCES;
       //exit(1);   
     }
@@ -299,15 +403,36 @@ unsigned int my_read(char *path, unsigned int n, char *data, int type)
   int i = 0, bytes_read = 0;
   char *temp1 = data;
 
-  if (parent.i_size > 0 ) {
-    fseek(fp, START_DATA_ADDR + parent.i_block[0] * BLOCK_SIZE, SEEK_SET);
-    
-    for (i = 0; i < parent.i_blocks - 1; i++) {
-      bytes_read += read_data(temp1, parent.i_block[i], BLOCK_SIZE);
-      temp1       += BLOCK_SIZE;
-    }
-    bytes_read = (parent.i_size % BLOCK_SIZE == 0) ?  bytes_read + read_data(temp1, parent.i_block[i], BLOCK_SIZE) : bytes_read + read_data(temp1, parent.i_block[i], parent.i_size % BLOCK_SIZE);
-  }  
+  if (parent.i_flags & INODE_INLINE) {
+    memcpy(temp1, parent.i_block, parent.i_size);
+    bytes_read = parent.i_size;
+  }
+  if (parent.i_flags & INODE_TAIL) {
+    image_seek(tail_addr(&parent));
+    bytes_read = image_read(temp1, 1, parent.i_size);
+  }
+
+  // compressed clusters are decompressed a cluster at a time
+  for (i = 0; (parent.i_flags & INODE_COMPRESSED) && bytes_read < parent.i_size; i++) {
+    char cluster[CLUSTER_SIZE];
+    int len = (parent.i_size - bytes_read < CLUSTER_SIZE) ? parent.i_size - bytes_read : CLUSTER_SIZE;
+
+    if (read_cluster(&parent, i, cluster) < 0) return -EIO;
+    memcpy(temp1, cluster, len);
+    bytes_read += len;
+    temp1      += len;
+  }
+
+  // holes read as zeros without touching the disk
+  for (i = 0; bytes_read < parent.i_size && i < DIRECT_BLOCKS; i++) {
+    int len = (parent.i_size - bytes_read < BLOCK_SIZE) ? parent.i_size - bytes_read : BLOCK_SIZE;
+
+    if (parent.i_block[i] == BLOCK_HOLE) memset(temp1, 0, len);
+    else                                 read_data(temp1, parent.i_block[i], len);
+    bytes_read += len;
+    temp1      += len;
+  }
+
   // update access time of parent inode
   parent.i_time = time(NULL);
   write_inode(&parent, parent_index);
@@ -324,14 +449,14 @@ int my_remove(char *path, unsigned int n, int type)
   
   // 1. create and validate path
   if (*(path + n - 1) == '/' && type == 1) {
-    printf("Invalid path\n");
+    log_msg(LVL_DEBUG, "Invalid path");
     return -ENOENT;
   }
   char *npath = create_path(path, n);
   if (npath == NULL) return -ENOMEM;
 
   if (strlen(npath) == 0) {
-    printf("Cannot remove root directory\n");
+    log_msg(LVL_DEBUG, "Cannot remove root directory");
     return -EBUSY;
   }
   
@@ -351,23 +476,24 @@ int my_remove(char *path, unsigned int n, int type)
   // 2. get the parent inode
   struct inode parent;
   read_inode(&parent, parent_index);
+  if (parent.i_flags & INODE_SNAPSHOT) return -EROFS;
  
   // check permissions
   if (parent.i_uid == getuid()) {
     if (check_permissions(parent.i_mode, S_IRUSR) == 0 || check_permissions(parent.i_mode, S_IWUSR) == 0) {
-      printf("User does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "User does not have read/write permissions");
       return -EACCES;
     }
   }
   else if (parent.i_gid == getgid()) {
     if (check_permissions(parent.i_mode, S_IRGRP) == 0 || check_permissions(parent.i_mode, S_IWGRP) == 0) {
-      printf("Group does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Group does not have read/write permissions");
       return -EACCES;
     }
   }
   else {
     if (check_permissions(parent.i_mode, S_IROTH) == 0 || check_permissions(parent.i_mode, S_IWOTH) == 0) {
-      printf("Other does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Other does not have read/write permissions");
       return -EACCES;
     }
   }
@@ -379,13 +505,13 @@ int my_remove(char *path, unsigned int n, int type)
 
   for (i = 0; i < entries; i++) {
     if (strcmp(dir[i].d_name, prev + 1) == 0) {
-      if (dir[i].d_file_type != type) {
+      if (dirent_is_type(dir[i].d_file_type, type) == 0) {
 	if (type == 2) {
-	  printf("%s is not a directory\n", npath);
+	  log_msg(LVL_DEBUG, "%s is not a directory", npath);
 	  return -ENOTDIR;
 	}
 	else {
-	  printf("%s is not a file\n", npath);
+	  log_msg(LVL_DEBUG, "%s is not a file", npath);
 	  return -EISDIR;
 	}
       }      
@@ -396,37 +522,32 @@ int my_remove(char *path, unsigned int n, int type)
 	// check permissions
 	if (child.i_uid == getuid()) {
 	  if (check_permissions(child.i_mode, S_IRUSR) == 0 || check_permissions(child.i_mode, S_IWUSR) == 0) {
-	    printf("User does not have read/write permissions\n");
+	    log_msg(LVL_DEBUG, "User does not have read/write permissions");
 	    return -EACCES;
 	  }
 	}
 	else if (child.i_gid == getgid()) {
 	  if (check_permissions(child.i_mode, S_IRGRP) == 0 || check_permissions(child.i_mode, S_IWGRP) == 0) {
-	    printf("Group does not have read/write permissions\n");
+	    log_msg(LVL_DEBUG, "Group does not have read/write permissions");
 	    return -EACCES;
 	  }
 	}
 	else {
 	  if (check_permissions(child.i_mode, S_IROTH) == 0 || check_permissions(child.i_mode, S_IWOTH) == 0) {
-	    printf("Other does not have read/write permissions\n");
+	    log_msg(LVL_DEBUG, "Other does not have read/write permissions");
 	    return -EACCES;
 	  }
 	}
 	
 	if (type == 2 && child.i_size > sizeof (struct directory_entry) * 2) {
-	  printf("directory is not empty\n");
+	  log_msg(LVL_DEBUG, "directory is not empty");
 	  return -ENOTEMPTY;
 	}
 	
 	// UPDATE Child Inodes delete time AND WRITE BACK TO DISK
 	if (child.i_links_count == 1) {
-	  int j;
-	  for (j = 0; j < child.i_blocks; j++) {
-	    block_bm[child.i_block[j] / 8] &= ~(1 << (child.i_block[j] % 8));
-	  }
-
+	  blocks                        = release_blocks(&child);
 	  inode_bm[dir[i].d_inode / 8] &= ~(1 << (dir[i].d_inode % 8));
-	  blocks                        = child.i_blocks;
 	  child.i_dtime                 = time(NULL);
 	}
 	else if (child.i_links_count > 1) {
@@ -495,6 +616,53 @@ unsigned int read_directory(char *path, unsigned int n, char *data)
   return my_read(path, n, data, 2);
 }
 
+/*
+ * For the file system image that is currently opened.
+ * Read the directory entries of the directory in the path provided.
+ * Make sure that the path is valid.
+ * Place the entries in entries (room for MAX_DIRENT) and return how many there are.
+ * Only the directory's own inode and data block are read, not the inodes of its entries.
+ */
+/**
+ *
+ */
+int list_directory(char *path, unsigned int n, struct directory_entry *entries)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int dir_index = validate_path(npath, 2);
+  free(npath);
+  if (dir_index < 0) return dir_index;
+
+  struct inode dir;
+  read_inode(&dir, dir_index);
+
+  // check permissions
+  if (dir.i_uid == getuid()) {
+    if (check_permissions(dir.i_mode, S_IRUSR) == 0) {
+      log_msg(LVL_DEBUG, "User does not have read permission");
+      return -EACCES;
+    }
+  }
+  else if (dir.i_gid == getgid()) {
+    if (check_permissions(dir.i_mode, S_IRGRP) == 0) {
+      log_msg(LVL_DEBUG, "Group does not have read permission");
+      return -EACCES;
+    }
+  }
+  else {
+    if (check_permissions(dir.i_mode, S_IROTH) == 0) {
+      log_msg(LVL_DEBUG, "Other does not have read permission");
+      return -EACCES;
+    }
+  }
+
+  read_direntry(entries, dir.i_block[0], MAX_DIRENT);
+
+  return dir.i_size / sizeof(struct directory_entry);
+}
+
 /*                                                                                                                                                                               
  * For the file system image that is currently opened.                                                                                                                           
  * Delete the directory in the path provided.                                                                                                                                    
@@ -508,6 +676,394 @@ int rm_directory(char *path, unsigned int n)
   return my_remove(path, n, 2);
 }
 
+/*
+ * For the file system image that is currently opened.
+ * Delete the directory in the path provided and everything below it.
+ */
+/**
+ *
+ */
+int rm_tree(char *path, unsigned int n)
+{
+  return remove_tree(path, n, 0);
+}
+
+/*
+ * Delete the directory in the path and everything below it. The subtree is walked once by
+ * inode number, without building paths for the children, and every permission is checked
+ * before anything changes. The freed inodes and blocks are then committed together: one
+ * write each for the parent's entries, the parent inode, the superblock and the bitmaps,
+ * plus one per file that keeps other hard links.
+ * With snapshot set the tree must be a snapshot, and it is removed without permission
+ * checks; without it nothing of a snapshot may be in the tree.
+ */
+/**
+ *
+ */
+int remove_tree(char *path, unsigned int n, int snapshot)
+{
+  // 1. create and validate path
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  if (strlen(npath) == 0) {
+    log_msg(LVL_DEBUG, "Cannot remove root directory");
+    return -EBUSY;
+  }
+
+  char *name = npath + 1;
+  char *prev = npath;
+  while (*name != '\0') {
+    if (*name == '/') prev = name;
+    name++;
+  }
+
+  char *temp       = strndup(npath, strlen(npath) - strlen(prev));
+  int parent_index = validate_path(temp, 2);
+  free(temp);
+
+  if (parent_index < 0) return parent_index;
+
+  // 2. get the parent inode and find the directory in it
+  struct inode parent;
+  read_inode(&parent, parent_index);
+
+  if (snapshot == 0 && (parent.i_flags & INODE_SNAPSHOT)) return -EROFS;
+  if (snapshot == 0 && check_rw_access(&parent) == 0) {
+    log_msg(LVL_DEBUG, "No read/write permissions on parent directory");
+    return -EACCES;
+  }
+
+  int i, entries = parent.i_size / sizeof(struct directory_entry);
+  struct directory_entry dir[MAX_DIRENT];
+  read_direntry(dir, parent.i_block[0], MAX_DIRENT);
+
+  for (i = 0; i < entries && strcmp(dir[i].d_name, prev + 1) != 0; i++);
+  if (i == entries) return -ENOENT;
+  if (dir[i].d_file_type != 2) {
+    log_msg(LVL_DEBUG, "%s is not a directory", npath);
+    return -ENOTDIR;
+  }
+
+  // 3. walk the subtree breadth first: directories go on a queue, and every link to a
+  //    file is counted against its inode (a file can be linked from several places)
+  uint32_t    *dirs    = malloc(sizeof(uint32_t) * sb.s_inodes_count);
+  uint32_t    *blocks  = malloc(sizeof(uint32_t) * sb.s_inodes_count);
+  uint16_t    *unlinks = calloc(sb.s_inodes_count, sizeof(uint16_t));
+  struct inode *files  = malloc(sizeof(struct inode) * sb.s_inodes_count);
+  if (dirs == NULL || blocks == NULL || unlinks == NULL || files == NULL) {
+    free(dirs); free(blocks); free(unlinks); free(files);
+    return -ENOMEM;
+  }
+
+  int ndirs = 0, next = 0, result = 0;
+  dirs[ndirs++] = dir[i].d_inode;
+
+  while (next < ndirs && result == 0) {
+    struct inode node;
+    read_inode(&node, dirs[next]);
+    blocks[next++] = node.i_block[0];
+
+    if ((node.i_flags & INODE_SNAPSHOT) ? !snapshot : snapshot) {
+      result = -EROFS;
+      break;
+    }
+    if (snapshot == 0 && check_rw_access(&node) == 0) {
+      result = -EACCES;
+      break;
+    }
+
+    int j, m = node.i_size / sizeof(struct directory_entry) - 2;
+    struct directory_entry children[MAX_DIRENT];
+    read_direntry(children, node.i_block[0], MAX_DIRENT);
+    if (m <= 0) continue;
+
+    // the children's inodes come in one pass over the inode table
+    struct inode nodes[MAX_DIRENT];
+    uint32_t index[MAX_DIRENT];
+    for (j = 0; j < m; j++) index[j] = children[j + 2].d_inode;
+    read_inodes(nodes, index, m);
+
+    for (j = 0; j < m; j++) {
+      if (snapshot == 0 && check_rw_access(&nodes[j]) == 0) {
+        result = -EACCES;
+        break;
+      }
+
+      if (children[j + 2].d_file_type == 2) {
+        dirs[ndirs++] = index[j];
+      }
+      else {
+        files[index[j]] = nodes[j];
+        unlinks[index[j]]++;
+      }
+    }
+  }
+
+  if (result < 0) {
+    if (result == -EACCES) log_msg(LVL_DEBUG, "No read/write permissions on everything below %s", npath);
+    free(dirs); free(blocks); free(unlinks); free(files);
+    return result;
+  }
+
+  // 4. release everything in memory
+  int freed_inodes = 0, freed_blocks = 0, k;
+  time_t t = time(NULL);
+
+  for (k = 0; k < ndirs; k++) {
+    inode_bm[dirs[k] / 8]   &= ~(1 << (dirs[k] % 8));
+    block_bm[blocks[k] / 8] &= ~(1 << (blocks[k] % 8));
+    freed_inodes++;
+    freed_blocks++;
+  }
+
+  for (k = 0; k < sb.s_inodes_count; k++) {
+    if (unlinks[k] == 0) continue;
+
+    // files that are still linked from outside the tree stay
+    if (files[k].i_links_count > unlinks[k]) {
+      files[k].i_links_count -= unlinks[k];
+      files[k].i_time         = t;
+      files[k].i_mtime        = t;
+      write_inode(&files[k], k);
+      continue;
+    }
+
+    freed_blocks += release_blocks(&files[k]);
+    inode_bm[k / 8] &= ~(1 << (k % 8));
+    freed_inodes++;
+  }
+
+  free(dirs); free(blocks); free(unlinks); free(files);
+
+  // 5. commit: the parent's entries and inode, then the superblock and bitmaps
+  while (i < entries - 1) {
+    dir[i] = dir[i + 1];
+    i++;
+  }
+  parent.i_time  = t;
+  parent.i_mtime = t;
+  parent.i_size -= sizeof(struct directory_entry);
+
+  write_direntry(dir, parent.i_block[0], entries - 1);
+  write_inode(&parent, parent_index);
+
+  sb.s_free_inodes_count += freed_inodes;
+  sb.s_free_blocks_count += freed_blocks;
+  write_superblock();
+  update_bitmaps();
+
+  return 0;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Take a snapshot of the tree below the root in SNAPSHOT_DIR/name. The tree is walked
+ * twice by inode number: once to count what the copy needs, so that nothing changes
+ * unless all of it fits, and once to copy the inodes and directory blocks. Files keep
+ * their blocks, which gain a reference each; tail packed files get a slot of their own.
+ */
+/**
+ *
+ */
+int make_snapshot(char *name, unsigned int n)
+{
+  // 1. check the name and find the snapshot directory, making it the first time
+  if (n == 0 || memchr(name, '/', n) != NULL) return -EINVAL;
+  if ((n == 1 && name[0] == '.') || (n == 2 && strncmp(name, "..", 2) == 0)) return -EINVAL;
+  if (n >= sizeof(((struct directory_entry *) 0)->d_name)) return -ENAMETOOLONG;
+
+  struct inode root;
+  struct directory_entry top[MAX_DIRENT];
+  int i, entries;
+
+  for (;;) {
+    read_inode(&root, START_INODE);
+    read_direntry(top, root.i_block[0], MAX_DIRENT);
+    entries = root.i_size / sizeof(struct directory_entry);
+    for (i = 2; i < entries && strcmp(top[i].d_name, SNAPSHOT_DIR) != 0; i++);
+    if (i < entries) break;
+
+    char path[] = "/" SNAPSHOT_DIR;
+    int result = my_create(path, strlen(path), 0, NULL, 2);
+    if (result < 0) return result;
+  }
+
+  uint32_t snap_index = top[i].d_inode;
+  struct inode snap;
+  struct directory_entry sdir[MAX_DIRENT];
+  read_inode(&snap, snap_index);
+  read_direntry(sdir, snap.i_block[0], MAX_DIRENT);
+
+  // a directory of that name the user filled is left alone, an empty one is taken over
+  if (top[i].d_file_type != 2) return -EEXIST;
+  if ((snap.i_flags & INODE_SNAPSHOT) == 0) {
+    if (snap.i_size > 2 * sizeof(struct directory_entry)) return -EEXIST;
+    snap.i_flags |= INODE_SNAPSHOT;
+    snap.i_mode  &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+    write_inode(&snap, snap_index);
+  }
+
+  int sentries = snap.i_size / sizeof(struct directory_entry);
+  for (i = 2; i < sentries; i++) {
+    if (strlen(sdir[i].d_name) == n && strncmp(sdir[i].d_name, name, n) == 0) return -EEXIST;
+  }
+  if (sentries >= MAX_DIRENT) return -ENOSPC;
+
+  // 2. count the inodes, directory blocks, tail slots and block references the copy needs.
+  //    map marks the inodes seen, so a file with several links is counted once
+  uint32_t *map  = calloc(sb.s_inodes_count, sizeof(uint32_t));
+  uint32_t *dirs = malloc(sizeof(uint32_t) * sb.s_inodes_count);
+  uint8_t  *refs = calloc(sb.s_blocks_count, sizeof(uint8_t));
+  if (map == NULL || dirs == NULL || refs == NULL) {
+    free(map); free(dirs); free(refs);
+    return -ENOMEM;
+  }
+
+  int ndirs = 0, next = 0, ninodes = 1, ntails = 0, nrefs = 0, result = 0, j, k;
+  dirs[ndirs++]    = START_INODE;
+  map[START_INODE] = 1;
+  csum_failed();
+
+  while (next < ndirs && result == 0) {
+    uint32_t index = dirs[next++];
+    struct inode node;
+    read_inode(&node, index);
+
+    int m = node.i_size / sizeof(struct directory_entry) - 2;
+    struct directory_entry children[MAX_DIRENT];
+    read_direntry(children, node.i_block[0], MAX_DIRENT);
+    if (m <= 0) continue;
+
+    struct inode nodes[MAX_DIRENT];
+    uint32_t child[MAX_DIRENT];
+    for (j = 0; j < m; j++) child[j] = children[j + 2].d_inode;
+    read_inodes(nodes, child, m);
+
+    for (j = 0; j < m && result == 0; j++) {
+      if (index == START_INODE && strcmp(children[j + 2].d_name, SNAPSHOT_DIR) == 0) continue;
+      if (map[child[j]]) continue;
+
+      map[child[j]] = 1;
+      ninodes++;
+      if (children[j + 2].d_file_type == 2) {
+        dirs[ndirs++] = child[j];
+        continue;
+      }
+
+      if (nodes[j].i_flags & INODE_TAIL) ntails++;
+      for (k = 0; k < file_slots(&nodes[j]); k++) {
+        uint32_t b = nodes[j].i_block[k];
+        if (b == BLOCK_HOLE || b == BLOCK_COMPRESSED) continue;
+
+        nrefs++;
+        if (block_rc[b] + ++refs[b] > UINT8_MAX) result = -EMLINK;
+      }
+    }
+  }
+  free(refs);
+
+  // a block needs room in the reference count table before it can be shared
+  uint32_t needed = ndirs + ntails;
+  if (nrefs > 0 && sb.s_refcount_block == 0) needed += (sb.s_blocks_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (result == 0 && csum_failed())                   result = -EIO;
+  if (result == 0 && ninodes > sb.s_free_inodes_count) result = -EDQUOT;
+  if (result == 0 && needed > sb.s_free_blocks_count)  result = -ENOSPC;
+  if (result == 0 && nrefs > 0 && sb.s_refcount_block == 0) result = init_refcounts();
+  if (result < 0) {
+    log_msg(LVL_WARN, "Cannot take snapshot %.*s - %s", n, name, strerror(-result));
+    free(map); free(dirs);
+    return result;
+  }
+
+  // 3. copy the tree: map now takes every inode to its copy, and a directory's copy
+  //    points at the copies of its children
+  int taken = 0;
+  memset(map, 0, sizeof(uint32_t) * sb.s_inodes_count);
+  ndirs = next     = 0;
+  dirs[ndirs++]    = START_INODE;
+  map[START_INODE] = get_inode();
+
+  while (next < ndirs) {
+    uint32_t index = dirs[next++];
+    struct inode node;
+    read_inode(&node, index);
+
+    int m = node.i_size / sizeof(struct directory_entry);
+    struct directory_entry children[MAX_DIRENT], copy[MAX_DIRENT];
+    read_direntry(children, node.i_block[0], MAX_DIRENT);
+
+    copy[0]         = children[0];
+    copy[0].d_inode = map[index];
+    copy[1]         = children[1];
+    copy[1].d_inode = (index == START_INODE) ? snap_index : map[children[1].d_inode];
+
+    for (j = 2, k = 2; j < m; j++) {
+      uint32_t c = children[j].d_inode;
+      if (index == START_INODE && strcmp(children[j].d_name, SNAPSHOT_DIR) == 0) continue;
+
+      if (map[c] == 0) {
+        map[c] = get_inode();
+        if (children[j].d_file_type == 2) dirs[ndirs++] = c;
+        else                              taken += snapshot_file(c, map[c]);
+      }
+      copy[k]           = children[j];
+      copy[k++].d_inode = map[c];
+    }
+
+    node.i_flags   |= INODE_SNAPSHOT;
+    node.i_block[0] = alloc_datablock();
+    node.i_size     = k * sizeof(struct directory_entry);
+    taken++;
+
+    write_direntry(copy, node.i_block[0], k);
+    write_inode(&node, map[index]);
+  }
+
+  // 4. commit: the entry in the snapshot directory, then the superblock and bitmaps
+  time_t t = time(NULL);
+
+  memset(&sdir[sentries], 0, sizeof(struct directory_entry));
+  sdir[sentries].d_inode     = map[START_INODE];
+  sdir[sentries].d_file_type = 2;
+  sdir[sentries].d_name_len  = n;
+  memcpy(sdir[sentries].d_name, name, n);
+
+  snap.i_size  += sizeof(struct directory_entry);
+  snap.i_time   = t;
+  snap.i_mtime  = t;
+  write_direntry(sdir, snap.i_block[0], sentries + 1);
+  write_inode(&snap, snap_index);
+
+  free(map); free(dirs);
+
+  sb.s_free_inodes_count -= ninodes;
+  sb.s_free_blocks_count -= taken;
+  write_superblock();
+  update_bitmaps();
+
+  return 0;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Delete the snapshot SNAPSHOT_DIR/name. Blocks it shares with the live tree or with other
+ * snapshots only lose a reference.
+ */
+/**
+ *
+ */
+int delete_snapshot(char *name, unsigned int n)
+{
+  if (n == 0 || memchr(name, '/', n) != NULL) return -EINVAL;
+
+  char path[sizeof(SNAPSHOT_DIR) + n + 2];
+  sprintf(path, "/%s/%.*s", SNAPSHOT_DIR, n, name);
+
+  return remove_tree(path, strlen(path), 1);
+}
+
 /*                                                                                                                                                                            
  * For the file system image that is currently opened.                                                                                                                        
  * Create a new file at path.                                                                                                                                                 
@@ -552,6 +1108,1113 @@ unsigned int read_file(char *path, unsigned int n, char *data)
   return my_read(path, n, data, 1);
 }
 
+/*
+ * For the file system image that is currently opened.
+ * Create a symbolic link at path whose contents are the target path.
+ */
+/**
+ *
+ */
+int make_symlink(char *path, unsigned int n, char *target)
+{
+  return my_create(path, n, strlen(target), target, 7);
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Copy the target of the symbolic link in the path provided into buf, null terminated
+ * and cut to size - 1 bytes. Unlike read_file the inode isn't written back, and a target
+ * kept inline needs no read beyond the inode.
+ */
+/**
+ *
+ */
+int read_symlink(char *path, unsigned int n, char *buf, size_t size)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (S_ISLNK(node.i_mode) == 0) return -EINVAL;
+  if (size == 0) return -EINVAL;
+
+  size_t len = (node.i_size < size - 1) ? node.i_size : size - 1;
+
+  struct extent ext[DIRECT_BLOCKS];
+  int i, count = map_extents(&node, index, len, 0, ext, DIRECT_BLOCKS);
+  char *at     = buf;
+  for (i = 0; i < count; i++) {
+    if (ext[i].e_pos == 0) {
+      memset(at, 0, ext[i].e_len);
+    }
+    else {
+      image_seek(ext[i].e_pos);
+      image_read(at, 1, ext[i].e_len);
+    }
+    at += ext[i].e_len;
+  }
+  *at = '\0';
+
+  return at - buf;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Find where offset..offset+size of the file in the path provided lives in the image.
+ * Make sure that the path is valid.
+ * Place the runs in ext (at most max of them) and return how many there are.
+ * Nothing is copied, so the caller can move the bytes straight from the image.
+ */
+/**
+ *
+ */
+int read_file_map(char *path, unsigned int n, size_t size, off_t offset, struct extent *ext, int max)
+{
+  if (*(path + n - 1) == '/') {
+    log_msg(LVL_DEBUG, "Invalid path");
+    return -ENOENT;
+  }
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (S_ISREG(node.i_mode) == 0 && S_ISLNK(node.i_mode) == 0) return -EISDIR;
+
+  // check permissions
+  if (node.i_uid == getuid()) {
+    if (check_permissions(node.i_mode, S_IRUSR) == 0) {
+      log_msg(LVL_DEBUG, "User does not have read permission");
+      return -EACCES;
+    }
+  }
+  else if (node.i_gid == getgid()) {
+    if (check_permissions(node.i_mode, S_IRGRP) == 0) {
+      log_msg(LVL_DEBUG, "Group does not have read permission");
+      return -EACCES;
+    }
+  }
+  else {
+    if (check_permissions(node.i_mode, S_IROTH) == 0) {
+      log_msg(LVL_DEBUG, "Other does not have read permission");
+      return -EACCES;
+    }
+  }
+
+  int count = map_extents(&node, index, size, offset, ext, max);
+
+  // update access time of the inode
+  node.i_time = time(NULL);
+  write_inode(&node, index);
+
+  return count;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Read size bytes at offset of the file in the path provided into data. Unlike
+ * read_file_map this copies the bytes itself, so it can decompress compressed clusters.
+ * Returns the number of bytes read.
+ */
+/**
+ *
+ */
+int read_file_data(char *path, unsigned int n, char *data, size_t size, off_t offset)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (check_r_access(&node) == 0) {
+    log_msg(LVL_DEBUG, "No read permission");
+    return -EACCES;
+  }
+
+  struct extent ext[DIRECT_BLOCKS];
+  char cluster[CLUSTER_SIZE];
+  int i, count = map_extents(&node, index, size, offset, ext, DIRECT_BLOCKS), loaded = -1;
+  size_t done  = 0;
+
+  for (i = 0; i < count; i++) {
+    if (ext[i].e_flags & EXTENT_COMPRESSED) {
+      uint32_t left = ext[i].e_len, at = offset + done;
+      while (left > 0) {
+        int c = at / CLUSTER_SIZE;
+        if (c != loaded && read_cluster(&node, c, cluster) < 0) return -EIO;
+        loaded = c;
+
+        uint32_t part = (c + 1) * CLUSTER_SIZE - at;
+        if (part > left) part = left;
+        memcpy(data + done, cluster + at % CLUSTER_SIZE, part);
+        done += part;
+        at   += part;
+        left -= part;
+      }
+      continue;
+    }
+
+    if (ext[i].e_pos == 0) {
+      memset(data + done, 0, ext[i].e_len);
+    }
+    else {
+      image_seek(ext[i].e_pos);
+      image_read(data + done, 1, ext[i].e_len);
+    }
+    done += ext[i].e_len;
+  }
+
+  // update access time of the inode
+  node.i_time = time(NULL);
+  write_inode(&node, index);
+
+  return done;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Get offset..offset+size of the file in the path provided ready to be written.
+ * Make sure that the path is valid.
+ * Blocks are allocated only for the range written; a gap between the old end of file
+ * and offset is left as holes. Parts of new blocks the write doesn't cover are zeroed.
+ * Place the runs in ext (at most max of them) and return how many there are.
+ */
+/**
+ *
+ */
+int write_file_map(char *path, unsigned int n, size_t size, off_t offset, struct extent *ext, int max)
+{
+  if (*(path + n - 1) == '/') {
+    log_msg(LVL_DEBUG, "Invalid path");
+    return -ENOENT;
+  }
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (S_ISREG(node.i_mode) == 0) return -EISDIR;
+  if (node.i_flags & INODE_SNAPSHOT) return -EROFS;
+
+  // check permissions
+  if (node.i_uid == getuid()) {
+    if (check_permissions(node.i_mode, S_IWUSR) == 0) {
+      log_msg(LVL_DEBUG, "User does not have write permission");
+      return -EACCES;
+    }
+  }
+  else if (node.i_gid == getgid()) {
+    if (check_permissions(node.i_mode, S_IWGRP) == 0) {
+      log_msg(LVL_DEBUG, "Group does not have write permission");
+      return -EACCES;
+    }
+  }
+  else {
+    if (check_permissions(node.i_mode, S_IWOTH) == 0) {
+      log_msg(LVL_DEBUG, "Other does not have write permission");
+      return -EACCES;
+    }
+  }
+
+  if (size == 0) return 0;
+  if (offset + size > DIRECT_BLOCKS * BLOCK_SIZE) return -EFBIG;
+
+  uint32_t end = offset + size;
+  time_t t     = time(NULL);
+
+  // a file without blocks that stays small is written into its inode, or into a slot of a
+  // shared tail block; bytes past i_size there are zeros
+  uint32_t grown = (end > node.i_size) ? end : node.i_size;
+  if (node.i_blocks == 0 && (node.i_flags & INODE_EOFBLOCKS) == 0 && grown <= TAIL_MAX) {
+    if (node.i_flags == 0 && grown <= INLINE_MAX) {
+      memset(node.i_block, 0, INLINE_MAX);
+      node.i_flags |= INODE_INLINE;
+    }
+    else if (grown > small_capacity(&node) && pack_tail(&node, grown) < 0) {
+      log_msg(LVL_WARN, "Disk is full");
+      return -ENOSPC;
+    }
+
+    node.i_size  = grown;
+    node.i_mtime = t;
+    node.i_time  = t;
+    write_inode(&node, index);
+    return map_extents(&node, index, size, offset, ext, max);
+  }
+  if (unpack_small(&node) < 0) {
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  // pointers past the end of file are holes (older images may have left junk there)
+  int i, slots = file_slots(&node), needed = 0;
+  for (i = slots; i < DIRECT_BLOCKS; i++) node.i_block[i] = BLOCK_HOLE;
+
+  // compressed clusters the write touches (or zeroes up to offset) go back to plain blocks
+  if (node.i_flags & INODE_COMPRESSED) {
+    int c, result = 0;
+    for (c = ((offset < node.i_size) ? offset : node.i_size) / CLUSTER_SIZE; c <= (end - 1) / CLUSTER_SIZE && result == 0; c++) {
+      result = expand_cluster(&node, c);
+    }
+    update_compressed_flag(&node);
+    write_inode(&node, index);
+    write_superblock();
+    update_bitmaps();
+    if (result < 0) return result;
+  }
+
+  // holes get a block, and blocks shared with other files get a copy of their own
+  uint32_t first = offset / BLOCK_SIZE, last = (end - 1) / BLOCK_SIZE;
+  for (i = first; i <= last; i++) if (node.i_block[i] == BLOCK_HOLE || block_shared(node.i_block[i])) needed++;
+  if (needed > sb.s_free_blocks_count) {
+    // a small file may already have moved to a block of its own above
+    write_inode(&node, index);
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  // bytes between the old end of file and offset must read back as zeros;
+  // whole blocks in that gap just stay holes
+  if (offset > node.i_size && zero_range(&node, node.i_size, offset) < 0) {
+    write_inode(&node, index);
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  int added = 0;
+  char data[BLOCK_SIZE] = "";
+  for (i = first; i <= last; i++) {
+    int shared = block_shared(node.i_block[i]);
+    if (node.i_block[i] != BLOCK_HOLE && shared == 0) continue;
+
+    int block = alloc_datablock();
+    if (block == -1) break;
+
+    // a new block the write won't cover completely may still hold an old file's bytes,
+    // and a copy keeps the bytes of the shared block the write doesn't cover
+    uint32_t start = i * BLOCK_SIZE;
+    if (offset > start || end < start + BLOCK_SIZE) {
+      if (shared) read_data(data, node.i_block[i], BLOCK_SIZE);
+      write_data(data, block, BLOCK_SIZE);
+      memset(data, 0, BLOCK_SIZE);
+    }
+
+    if (shared) free_block(node.i_block[i]);
+    else        node.i_blocks += 1;
+    node.i_block[i] = block;
+    added++;
+  }
+
+  int fits = (added == needed);
+  if (fits && end > node.i_size) node.i_size = end;
+  update_eof_flag(&node);
+  node.i_mtime = t;
+  node.i_time  = t;
+  write_inode(&node, index);
+
+  if (added > 0) {
+    sb.s_free_blocks_count -= added;
+    write_superblock();
+    update_bitmaps();
+  }
+
+  if (fits == 0) {
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  return map_extents(&node, index, size, offset, ext, max);
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Write size bytes of data at offset of the file in the path provided, compressing every
+ * cluster the write touches (see write_cluster). Each is read back, decompressed if needed,
+ * patched and stored again. Files small enough for their inode or a tail block, and files
+ * with preallocated blocks, go through write_file_map and are written in place.
+ * Returns the number of bytes written, which is short if the disk fills up part way.
+ */
+/**
+ *
+ */
+int write_file_compressed(char *path, unsigned int n, char *data, size_t size, off_t offset)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (S_ISREG(node.i_mode) == 0) return -EISDIR;
+  if (node.i_flags & INODE_SNAPSHOT) return -EROFS;
+  if (check_w_access(&node) == 0) {
+    log_msg(LVL_DEBUG, "No write permission");
+    return -EACCES;
+  }
+
+  if (size == 0) return 0;
+  if (offset + size > DIRECT_BLOCKS * BLOCK_SIZE) return -EFBIG;
+
+  uint32_t end   = offset + size;
+  uint32_t grown = (end > node.i_size) ? end : node.i_size;
+  int i;
+
+  if ((node.i_blocks == 0 && grown <= TAIL_MAX) || (node.i_flags & INODE_EOFBLOCKS)) {
+    struct extent ext[DIRECT_BLOCKS];
+    int count = write_file_map(path, n, size, offset, ext, DIRECT_BLOCKS);
+    if (count < 0) return count;
+
+    size_t done = 0;
+    for (i = 0; i < count; i++) {
+      image_seek(ext[i].e_pos);
+      image_write(data + done, 1, ext[i].e_len);
+      done += ext[i].e_len;
+    }
+    update_file_csums(path, n, offset, done);
+    return done;
+  }
+
+  if (unpack_small(&node) < 0) {
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  // pointers past the end of file are holes (older images may have left junk there)
+  for (i = file_slots(&node); i < DIRECT_BLOCKS; i++) node.i_block[i] = BLOCK_HOLE;
+
+  // bytes between the old end of file and offset must read back as zeros
+  if (offset > node.i_size && zero_range(&node, node.i_size, offset) < 0) {
+    write_inode(&node, index);
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  char cluster[CLUSTER_SIZE];
+  int c, result = 0;
+  for (c = offset / CLUSTER_SIZE; c <= (end - 1) / CLUSTER_SIZE; c++) {
+    uint32_t start = c * CLUSTER_SIZE;
+    if ((result = read_cluster(&node, c, cluster)) < 0) break;
+
+    // what the cluster's blocks hold past the old end of file is stale
+    if (node.i_size < start + CLUSTER_SIZE) {
+      uint32_t from = (node.i_size > start) ? node.i_size - start : 0;
+      memset(cluster + from, 0, CLUSTER_SIZE - from);
+    }
+
+    uint32_t lo = (offset > start) ? offset : start;
+    uint32_t hi = (end < start + CLUSTER_SIZE) ? end : start + CLUSTER_SIZE;
+    memcpy(cluster + lo - start, data + lo - offset, hi - lo);
+
+    uint32_t len = (grown - start < CLUSTER_SIZE) ? grown - start : CLUSTER_SIZE;
+    if ((result = write_cluster(&node, c, cluster, len, 1)) < 0) break;
+  }
+
+  // clusters before c made it to disk
+  uint32_t written = (c * CLUSTER_SIZE < end) ? c * CLUSTER_SIZE : end;
+  if (written > node.i_size) node.i_size = written;
+
+  update_compressed_flag(&node);
+  time_t t     = time(NULL);
+  node.i_mtime = t;
+  node.i_time  = t;
+  write_inode(&node, index);
+  write_superblock();
+  update_bitmaps();
+
+  if (written > offset) return written - offset;
+  if (result < 0) log_msg(LVL_WARN, "Disk is full");
+  return result;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Check the blocks under offset..offset+size of the file in the path provided against their
+ * checksums, if the image checksums file data. Each block is read and checked once after
+ * the image is opened; the reads that follow come from the kernel's page cache or from
+ * blocks that were checked already. A compressed cluster is checked as a whole.
+ */
+/**
+ *
+ */
+int verify_file_data(char *path, unsigned int n, off_t offset, size_t size)
+{
+  if ((sb.s_flags & SB_DATA_CSUM) == 0) return 0;
+
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (offset >= node.i_size || size == 0 || (node.i_flags & INODE_INLINE)) return 0;
+  if (node.i_flags & INODE_TAIL) return check_block(node.i_block[0]);
+
+  uint32_t end   = (offset + size < node.i_size) ? offset + size : node.i_size;
+  uint32_t first = offset / BLOCK_SIZE, last = (end - 1) / BLOCK_SIZE, i;
+  if (node.i_flags & INODE_COMPRESSED) {
+    first = first / CLUSTER_BLOCKS * CLUSTER_BLOCKS;
+    last  = last / CLUSTER_BLOCKS * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1;
+  }
+
+  for (i = first; i <= last && i < DIRECT_BLOCKS; i++) {
+    if (node.i_block[i] == BLOCK_HOLE || node.i_block[i] == BLOCK_COMPRESSED) continue;
+    if (check_block(node.i_block[i]) < 0) return -EIO;
+  }
+
+  return 0;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Bring the checksums of the file in the path provided up to date after offset..offset+size
+ * was written in place: the inode of an inline file, else the tail block or the blocks
+ * under the range if the image checksums file data.
+ */
+/**
+ *
+ */
+int update_file_csums(char *path, unsigned int n, off_t offset, size_t size)
+{
+  if ((sb.s_flags & SB_METADATA_CSUM) == 0 || size == 0) return 0;
+
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (node.i_flags & INODE_INLINE) {
+    csum_inode(&node, index);
+    return 0;
+  }
+  if (node.i_flags & INODE_TAIL) {
+    csum_refresh(node.i_block[0]);
+    return 0;
+  }
+
+  uint32_t i;
+  for (i = offset / BLOCK_SIZE; i <= (offset + size - 1) / BLOCK_SIZE && i < DIRECT_BLOCKS; i++) {
+    if (node.i_block[i] != BLOCK_HOLE && node.i_block[i] != BLOCK_COMPRESSED) csum_refresh(node.i_block[i]);
+  }
+
+  return 0;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Deduplicate the blocks of the file in the path provided that lie wholly in
+ * offset..offset+size and inside the file. Each is hashed and looked up in the dedup
+ * index (built from every file on first use); a block of any file with the same bytes
+ * takes its place and one reference more, and the file's own block is dropped.
+ * Returns the number of blocks that were freed.
+ */
+/**
+ *
+ */
+int dedup_file(char *path, unsigned int n, off_t offset, size_t size)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (S_ISREG(node.i_mode) == 0) return -EISDIR;
+  if (node.i_flags & INODE_SNAPSHOT) return -EROFS;
+  if (check_w_access(&node) == 0) {
+    log_msg(LVL_DEBUG, "No write permission");
+    return -EACCES;
+  }
+
+  if (offset < 0) return -EINVAL;
+  if (node.i_flags & (INODE_INLINE | INODE_TAIL)) return 0;
+
+  uint32_t end = (offset + size < node.i_size) ? offset + size : node.i_size;
+  int i, freed = 0, shared = 0;
+
+  dedup_build();
+  for (i = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE; (i + 1) * BLOCK_SIZE <= end; i++) {
+    uint32_t block = node.i_block[i];
+    freed += dedup_block(&node, i);
+    if (node.i_block[i] != block) shared++;
+  }
+
+  if (shared > 0) {
+    write_inode(&node, index);
+    sb.s_free_blocks_count += freed;
+    write_superblock();
+    update_bitmaps();
+  }
+
+  return freed;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Make len bytes at dst_off of the file at "*to" a copy of the bytes at src_off of the
+ * file at "*from", without the data leaving the image. Where both offsets are block
+ * aligned and neither file is small or compressed, whole blocks are shared with the
+ * source and gain a reference (the last one too if it ends both files); the rest is read
+ * and written again. len 0 means up to the end of the source.
+ * Returns the number of bytes cloned, which is short if the disk fills up part way.
+ */
+/**
+ *
+ */
+int clone_file(char *from, unsigned int n, char *to, unsigned int m, off_t src_off, off_t dst_off, size_t len)
+{
+  // 1. find both files and check what may be done to them
+  char *src_path = create_path(from, n);
+  char *dst_path = create_path(to, m);
+  if (src_path == NULL || dst_path == NULL) return -ENOMEM;
+
+  int sindex = validate_path(src_path, 1);
+  int dindex = validate_path(dst_path, 1);
+  free(src_path);
+  free(dst_path);
+  if (sindex < 0) return sindex;
+  if (dindex < 0) return dindex;
+
+  struct inode src_node, dst;
+  read_inode(&dst, dindex);
+  read_inode(&src_node, sindex);
+  struct inode *src = (sindex == dindex) ? &dst : &src_node;
+
+  if (S_ISREG(src->i_mode) == 0 || S_ISREG(dst.i_mode) == 0) return -EISDIR;
+  if (dst.i_flags & INODE_SNAPSHOT) return -EROFS;
+  if (check_r_access(src) == 0 || check_w_access(&dst) == 0) {
+    log_msg(LVL_DEBUG, "No read/write permissions");
+    return -EACCES;
+  }
+
+  if (src_off < 0 || dst_off < 0) return -EINVAL;
+  if (src_off >= src->i_size) return 0;
+  if (len == 0 || src_off + len > src->i_size) len = src->i_size - src_off;
+  if (dst_off + len > DIRECT_BLOCKS * BLOCK_SIZE) return -EFBIG;
+  if (sindex == dindex && src_off < dst_off + len && dst_off < src_off + len) return -EINVAL;
+
+  // 2. share whole blocks where the layout allows it
+  uint32_t shared = 0, refs = 0;
+  int nb = len / BLOCK_SIZE, k, freed = 0;
+  int si = src_off / BLOCK_SIZE, di = dst_off / BLOCK_SIZE;
+
+  if (src_off + len == src->i_size && dst_off + len >= dst.i_size && len % BLOCK_SIZE) nb++;
+  if (src_off % BLOCK_SIZE || dst_off % BLOCK_SIZE) nb = 0;
+  if ((src->i_flags | dst.i_flags) & (INODE_INLINE | INODE_TAIL | INODE_COMPRESSED)) nb = 0;
+
+  for (k = 0; k < nb; k++) {
+    uint32_t b = src->i_block[si + k];
+    if (b == BLOCK_HOLE) continue;
+    if (block_rc[b] == UINT8_MAX) nb = 0;
+    refs++;
+  }
+  if (nb > 0 && refs > 0 && sb.s_refcount_block == 0 && init_refcounts() < 0) nb = 0;
+
+  // pointers past the end of file are holes (older images may have left junk there), and
+  // the bytes between the old end of file and dst_off must read back as zeros
+  if (nb > 0) {
+    for (k = file_slots(&dst); k < DIRECT_BLOCKS; k++) dst.i_block[k] = BLOCK_HOLE;
+  }
+  if (nb > 0 && dst_off > dst.i_size) {
+    if (zero_range(&dst, dst.i_size, dst_off) < 0) {
+      write_inode(&dst, dindex);
+      log_msg(LVL_WARN, "Disk is full");
+      return -ENOSPC;
+    }
+  }
+
+  for (k = 0; k < nb; k++) {
+    uint32_t b = src->i_block[si + k], old = dst.i_block[di + k];
+    if (b == old) continue;
+
+    if (b != BLOCK_HOLE) {
+      block_rc[b]++;
+      write_refcount(b);
+      dst.i_blocks++;
+    }
+    if (old != BLOCK_HOLE) {
+      freed += free_block(old);
+      dst.i_blocks--;
+    }
+    dst.i_block[di + k] = b;
+  }
+
+  if (nb > 0) {
+    shared = (nb * BLOCK_SIZE < len) ? nb * BLOCK_SIZE : len;
+    if (dst_off + shared > dst.i_size) dst.i_size = dst_off + shared;
+    update_eof_flag(&dst);
+
+    time_t t    = time(NULL);
+    dst.i_mtime = t;
+    dst.i_time  = t;
+    write_inode(&dst, dindex);
+
+    sb.s_free_blocks_count += freed;
+    write_superblock();
+    update_bitmaps();
+  }
+  if (shared == len) return len;
+
+  // 3. copy the rest through memory, at most the size of a file
+  char data[DIRECT_BLOCKS * BLOCK_SIZE];
+  struct extent ext[DIRECT_BLOCKS];
+  int got = read_file_data(from, n, data, len - shared, src_off + shared);
+  if (got < 0) return shared ? shared : got;
+
+  int count = write_file_map(to, m, got, dst_off + shared, ext, DIRECT_BLOCKS);
+  if (count < 0) return shared ? shared : count;
+
+  size_t done = 0;
+  for (k = 0; k < count; k++) {
+    image_seek(ext[k].e_pos);
+    image_write(data + done, 1, ext[k].e_len);
+    done += ext[k].e_len;
+  }
+  update_file_csums(to, m, dst_off + shared, done);
+
+  return shared + done;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Starting at offset, find the next byte of the file in the path provided that is data
+ * (whence SEEK_DATA) or in a hole (whence SEEK_HOLE), like lseek(2) does.
+ * The end of the file counts as a hole. Returns -ENXIO if offset is past the end of file.
+ */
+/**
+ *
+ */
+off_t seek_file(char *path, unsigned int n, off_t offset, int whence)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) return -EINVAL;
+  if (offset < 0 || offset >= node.i_size) return -ENXIO;
+
+  if (node.i_flags & (INODE_INLINE | INODE_TAIL)) return (whence == SEEK_DATA) ? offset : (off_t) node.i_size;
+
+  int i;
+  for (i = offset / BLOCK_SIZE; i < file_slots(&node) && i * BLOCK_SIZE < node.i_size; i++) {
+    int hole = (node.i_block[i] == BLOCK_HOLE);
+    if (hole == (whence == SEEK_HOLE)) return (i * BLOCK_SIZE > offset) ? i * BLOCK_SIZE : offset;
+  }
+
+  return (whence == SEEK_HOLE) ? (off_t) node.i_size : -ENXIO;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Set the size of the file in the path provided to size, like truncate(2).
+ * Shrinking frees every block past the new end (preallocated ones too) and writes the
+ * bitmap once. Growing allocates nothing: the bytes past the old end are zeroed where
+ * the file already has blocks and the rest is a hole.
+ */
+/**
+ *
+ */
+int truncate_file(char *path, unsigned int n, off_t size)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (S_ISREG(node.i_mode) == 0) return -EISDIR;
+  if (node.i_flags & INODE_SNAPSHOT) return -EROFS;
+  if (check_w_access(&node) == 0) {
+    log_msg(LVL_DEBUG, "No write permission");
+    return -EACCES;
+  }
+
+  if (size < 0) return -EINVAL;
+  if (size > DIRECT_BLOCKS * BLOCK_SIZE) return -EFBIG;
+
+  time_t t = time(NULL);
+
+  // inline and tail bytes past the end of file are kept zero, so growing reads back zeros
+  if ((node.i_flags & (INODE_INLINE | INODE_TAIL)) && size <= TAIL_MAX) {
+    if (size > small_capacity(&node)) {
+      if (pack_tail(&node, size) < 0) {
+        log_msg(LVL_WARN, "Disk is full");
+        return -ENOSPC;
+      }
+    }
+    else if (size < node.i_size && (node.i_flags & INODE_INLINE)) {
+      memset((char *) node.i_block + size, 0, node.i_size - size);
+    }
+    else if (size < node.i_size) {
+      char zero[TAIL_MAX] = "";
+      image_seek(tail_addr(&node) + size);
+      image_write(zero, 1, node.i_size - size);
+      csum_refresh(node.i_block[0]);
+    }
+
+    node.i_size  = size;
+    node.i_mtime = t;
+    node.i_time  = t;
+    write_inode(&node, index);
+    return 0;
+  }
+  if (unpack_small(&node) < 0) {
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  // pointers past the end of file are holes (older images may have left junk there)
+  int i, slots = file_slots(&node), freed = 0;
+  for (i = slots; i < DIRECT_BLOCKS; i++) node.i_block[i] = BLOCK_HOLE;
+
+  // a compressed cluster the new end cuts through is stored plain first, so it can be cut
+  int expanded = 0;
+  if ((node.i_flags & INODE_COMPRESSED) && size < node.i_size && size % CLUSTER_SIZE != 0) {
+    int result = expand_cluster(&node, size / CLUSTER_SIZE);
+    if (result < 0) return result;
+    expanded = 1;
+  }
+
+  // the bytes past the old end are zeroed before anything is freed, as a shared block
+  // there needs a copy of its own
+  if (size > node.i_size && zero_range(&node, node.i_size, size) < 0) {
+    write_inode(&node, index);
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  if (size < node.i_size || (node.i_flags & INODE_EOFBLOCKS)) {
+    for (i = (size + BLOCK_SIZE - 1) / BLOCK_SIZE; i < DIRECT_BLOCKS; i++) {
+      if (node.i_block[i] == BLOCK_HOLE) continue;
+      if (node.i_block[i] != BLOCK_COMPRESSED) {
+        freed += free_block(node.i_block[i]);
+        node.i_blocks -= 1;
+      }
+      node.i_block[i] = BLOCK_HOLE;
+    }
+  }
+  update_compressed_flag(&node);
+
+  node.i_size  = size;
+  update_eof_flag(&node);
+  node.i_mtime = t;
+  node.i_time  = t;
+  write_inode(&node, index);
+
+  if (freed > 0 || expanded) {
+    sb.s_free_blocks_count += freed;
+    write_superblock();
+    update_bitmaps();
+  }
+
+  return 0;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Allocate blocks for the holes in offset..offset+len of the file in the path provided,
+ * like fallocate(2). The new blocks are taken as one contiguous run if the bitmap has
+ * one and are zeroed, so later writes there need no allocation. Unless mode has
+ * FALLOC_FL_KEEP_SIZE the file grows to offset+len; with it, blocks past the end of file
+ * are kept (INODE_EOFBLOCKS) until a truncate or a write past them.
+ * Either all the blocks are allocated or none (-ENOSPC).
+ */
+/**
+ *
+ */
+int allocate_file(char *path, unsigned int n, int mode, off_t offset, off_t len)
+{
+  char *npath = create_path(path, n);
+  if (npath == NULL) return -ENOMEM;
+
+  int index = validate_path(npath, 1);
+  free(npath);
+  if (index < 0) return index;
+
+  struct inode node;
+  read_inode(&node, index);
+
+  if (S_ISREG(node.i_mode) == 0) return -ENODEV;
+  if (node.i_flags & INODE_SNAPSHOT) return -EROFS;
+  if (check_w_access(&node) == 0) {
+    log_msg(LVL_DEBUG, "No write permission");
+    return -EACCES;
+  }
+
+  if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+  if (offset < 0 || len <= 0) return -EINVAL;
+  if (offset + len > DIRECT_BLOCKS * BLOCK_SIZE) return -EFBIG;
+
+  // the caller wants real blocks, so an inline or tail packed file moves out first
+  if (unpack_small(&node) < 0) {
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  // pointers past the end of file are holes (older images may have left junk there)
+  int i, slots = file_slots(&node), needed = 0;
+  for (i = slots; i < DIRECT_BLOCKS; i++) node.i_block[i] = BLOCK_HOLE;
+
+  uint32_t end   = offset + len;
+  uint32_t first = offset / BLOCK_SIZE, last = (end - 1) / BLOCK_SIZE;
+  for (i = first; i <= last; i++) if (node.i_block[i] == BLOCK_HOLE) needed++;
+
+  // the old blocks may hold stale bytes past the end of file that would become visible
+  uint32_t blocks[DIRECT_BLOCKS];
+  int zeroed = 0;
+  if ((mode & FALLOC_FL_KEEP_SIZE) == 0 && end > node.i_size) zeroed = zero_range(&node, node.i_size, end);
+
+  if (zeroed < 0 || needed > sb.s_free_blocks_count || alloc_run(blocks, needed) == -1) {
+    write_inode(&node, index);
+    log_msg(LVL_WARN, "Disk is full");
+    return -ENOSPC;
+  }
+
+  int j = 0;
+  char zero[1] = "";
+  for (i = first; i <= last; i++) {
+    if (node.i_block[i] != BLOCK_HOLE) continue;
+
+    write_data(zero, blocks[j], 0);
+    node.i_block[i] = blocks[j++];
+    node.i_blocks  += 1;
+  }
+
+  time_t t = time(NULL);
+  if ((mode & FALLOC_FL_KEEP_SIZE) == 0 && end > node.i_size) {
+    node.i_size  = end;
+    node.i_mtime = t;
+  }
+  node.i_time = t;
+  update_eof_flag(&node);
+  write_inode(&node, index);
+
+  if (needed > 0) {
+    sb.s_free_blocks_count -= needed;
+    write_superblock();
+    update_bitmaps();
+  }
+
+  return 0;
+}
+
+/*
+ * For the file system image that is currently opened.
+ * Move the entry at from to to. The entry is taken out of one parent's block and put
+ * in the other's (or renamed in place), so no data moves. A file at to is unlinked
+ * and an empty directory at to is removed first. A directory that changes parent gets
+ * its ".." entry pointed at the new parent.
+ */
+/**
+ *
+ */
+int rename_path(char *from, unsigned int n, char *to, unsigned int m)
+{
+  // 1. create and validate both paths
+  char *src = create_path(from, n);
+  char *dst = create_path(to, m);
+  if (src == NULL || dst == NULL) return -ENOMEM;
+  if (strlen(src) == 0 || strlen(dst) == 0) return -EBUSY;
+
+  char src_name[strlen(src) + 1], dst_name[strlen(dst) + 1];
+  strcpy(src_name, strrchr(src, '/') + 1);
+  strcpy(dst_name, strrchr(dst, '/') + 1);
+
+  *strrchr(src, '/') = '\0';
+  *strrchr(dst, '/') = '\0';
+  int src_parent = validate_path(src, 2);
+  int dst_parent = validate_path(dst, 2);
+  free(src);
+  free(dst);
+
+  if (src_parent < 0) return src_parent;
+  if (dst_parent < 0) return dst_parent;
+  if (strlen(dst_name) >= sizeof(((struct directory_entry *) 0)->d_name)) return -ENAMETOOLONG;
+
+  // 2. get both parents and their entries; a rename inside one directory uses one copy
+  struct inode sparent, dparent_node, *dparent = &dparent_node;
+  struct directory_entry sdir[MAX_DIRENT], ddir_entries[MAX_DIRENT], *ddir = ddir_entries;
+
+  read_inode(&sparent, src_parent);
+  read_direntry(sdir, sparent.i_block[0], MAX_DIRENT);
+  if (dst_parent == src_parent) {
+    dparent = &sparent;
+    ddir    = sdir;
+  }
+  else {
+    read_inode(dparent, dst_parent);
+    read_direntry(ddir, dparent->i_block[0], MAX_DIRENT);
+  }
+
+  if ((sparent.i_flags | dparent->i_flags) & INODE_SNAPSHOT) return -EROFS;
+
+  // the snapshot directory stays where snapshots are looked for
+  if ((src_parent == START_INODE && strcmp(src_name, SNAPSHOT_DIR) == 0) ||
+      (dst_parent == START_INODE && strcmp(dst_name, SNAPSHOT_DIR) == 0)) return -EROFS;
+  if (check_rw_access(&sparent) == 0 || check_rw_access(dparent) == 0) {
+    log_msg(LVL_DEBUG, "No read/write permissions on parent directory");
+    return -EACCES;
+  }
+
+  int i, j, sentries = sparent.i_size / sizeof(struct directory_entry);
+  int dentries = dparent->i_size / sizeof(struct directory_entry);
+
+  for (i = 2; i < sentries && strcmp(sdir[i].d_name, src_name) != 0; i++);
+  if (i >= sentries) return -ENOENT;
+  for (j = 2; j < dentries && strcmp(ddir[j].d_name, dst_name) != 0; j++);
+
+  struct directory_entry moved = sdir[i];
+  if (j < dentries && ddir[j].d_inode == moved.d_inode) return 0;
+
+  // renaming inside a directory to a new name just rewrites the entry where it is
+  int in_place = (dparent == &sparent && j == dentries);
+
+  // 3. a directory can't be moved below itself: walk up from the new parent
+  if (moved.d_file_type == 2 && dst_parent != src_parent) {
+    uint32_t up = dst_parent;
+    while (up != START_INODE) {
+      if (up == moved.d_inode) return -EINVAL;
+
+      struct inode node;
+      struct directory_entry entries[MAX_DIRENT];
+      read_inode(&node, up);
+      read_direntry(entries, node.i_block[0], MAX_DIRENT);
+      up = entries[1].d_inode;
+    }
+  }
+
+  // 4. get rid of what is at the destination
+  int freed_inodes = 0, freed_blocks = 0;
+  time_t t = time(NULL);
+
+  if (j < dentries) {
+    struct inode old;
+    read_inode(&old, ddir[j].d_inode);
+
+    if (moved.d_file_type == 2 && ddir[j].d_file_type != 2) return -ENOTDIR;
+    if (moved.d_file_type != 2 && ddir[j].d_file_type == 2) return -EISDIR;
+    if (ddir[j].d_file_type == 2 && old.i_size > sizeof(struct directory_entry) * 2) return -ENOTEMPTY;
+    if (check_rw_access(&old) == 0) return -EACCES;
+
+    if (ddir[j].d_file_type == 2 || old.i_links_count <= 1) {
+      freed_blocks = release_blocks(&old);
+      freed_inodes = 1;
+      inode_bm[ddir[j].d_inode / 8] &= ~(1 << (ddir[j].d_inode % 8));
+      old.i_dtime  = t;
+    }
+    else {
+      old.i_links_count -= 1;
+      old.i_time         = t;
+    }
+    write_inode(&old, ddir[j].d_inode);
+  }
+  else if (in_place == 0 && dentries >= MAX_DIRENT) {
+    log_msg(LVL_DEBUG, "Cannot add more directories to this path");
+    return -ENOSPC;
+  }
+
+  // 5. move the entry
+  memset(moved.d_name, 0, sizeof(moved.d_name));
+  strcpy(moved.d_name, dst_name);
+  moved.d_name_len = strlen(dst_name);
+
+  if (in_place) {
+    sdir[i] = moved;
+  }
+  else {
+    ddir[j] = moved;
+    if (j == dentries) {
+      dentries++;
+      dparent->i_size += sizeof(struct directory_entry);
+    }
+
+    // inside one directory the source entries are the destination entries
+    if (dparent == &sparent) sentries = dentries;
+    for (; i < sentries - 1; i++) sdir[i] = sdir[i + 1];
+    sentries--;
+    sparent.i_size -= sizeof(struct directory_entry);
+  }
+
+  // 6. a directory that changed parent needs its ".." fixed
+  if (moved.d_file_type == 2 && dst_parent != src_parent) {
+    struct inode node;
+    struct directory_entry entries[MAX_DIRENT];
+    read_inode(&node, moved.d_inode);
+    read_direntry(entries, node.i_block[0], MAX_DIRENT);
+    entries[1].d_inode = dst_parent;
+    write_direntry(entries, node.i_block[0], node.i_size / sizeof(struct directory_entry));
+  }
+
+  // 7. write back the parents, and the superblock and bitmaps if something was freed
+  sparent.i_time  = t;
+  sparent.i_mtime = t;
+  write_direntry(sdir, sparent.i_block[0], sentries);
+  write_inode(&sparent, src_parent);
+
+  if (dparent != &sparent) {
+    dparent->i_time  = t;
+    dparent->i_mtime = t;
+    write_direntry(ddir, dparent->i_block[0], dentries);
+    write_inode(dparent, dst_parent);
+  }
+
+  if (freed_inodes > 0) {
+    sb.s_free_inodes_count += freed_inodes;
+    sb.s_free_blocks_count += freed_blocks;
+    write_superblock();
+    update_bitmaps();
+  }
+
+  return 0;
+}
+
 /*                                                                                                                                                                            
  * make a new hard link in the path to target                                                                                                                                 
  * make sure that the path and target are both valid.                                                                                                                         
@@ -563,7 +2226,7 @@ int make_link(char *path, unsigned int n, char *target)
 { 
   // 1. create and validate path
   if (*(path + n - 1) == '/') {
-    printf("Invalid path\n");
+    log_msg(LVL_DEBUG, "Invalid path");
     return -1;
     //exit(1);   
   }
@@ -585,7 +2248,7 @@ int make_link(char *path, unsigned int n, char *target)
   
   // 2. create and validate path of target
   if (*(target + strlen(target) - 1) == '/') {
-    printf("Invalid path\n");
+    log_msg(LVL_DEBUG, "Invalid path");
     return -1;
     //exit(1);   
   }
@@ -598,25 +2261,26 @@ int make_link(char *path, unsigned int n, char *target)
   // 3. get path's parent inode
   struct inode path_inode;
   read_inode(&path_inode, link_parent_index);
+  if (path_inode.i_flags & INODE_SNAPSHOT) return -EROFS;
 
   // check permissions for path's inode
   if (path_inode.i_uid == getuid()) {
     if (check_permissions(path_inode.i_mode, S_IRUSR) == 0 || check_permissions(path_inode.i_mode, S_IWUSR) == 0) {
-      printf("User does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "User does not have read/write permissions");
       return -1;
       //exit(1);   
     }
   }
   else if (path_inode.i_gid == getgid()) {
     if (check_permissions(path_inode.i_mode, S_IRGRP) == 0 || check_permissions(path_inode.i_mode, S_IWGRP) == 0) {
-      printf("Group does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Group does not have read/write permissions");
       return -1;
       //exit(1);   
     }
   }
   else {
     if (check_permissions(path_inode.i_mode, S_IROTH) == 0 || check_permissions(path_inode.i_mode, S_IWOTH) == 0) {
-      printf("Other does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Other does not have read/write permissions");
       return -1;
       //exit(1);   
     }
@@ -624,7 +2288,7 @@ int make_link(char *path, unsigned int n, char *target)
   
   // If max directories already present, then don't create new
   if (path_inode.i_size >= sizeof(struct directory_entry) * MAX_DIRENT) {
-    printf("Cannot add more directories to this path\n");
+    log_msg(LVL_DEBUG, "Cannot add more directories to this path");
     return -1;
     //exit(1);   
   }
@@ -635,7 +2299,7 @@ int make_link(char *path, unsigned int n, char *target)
   read_direntry(dir, path_inode.i_block[0], MAX_DIRENT);
   for (j = 0; j < entries; j++) {
     if (strcmp(dir[j].d_name, prev + 1) == 0) {
-      printf("Target already exists\n");
+      log_msg(LVL_DEBUG, "Target already exists");
       return -1;
       //exit(1);   
     }
@@ -644,25 +2308,26 @@ int make_link(char *path, unsigned int n, char *target)
   // 3. get target's parent inode
   struct inode target_inode;
   read_inode(&target_inode, target_parent_index);
+  if (target_inode.i_flags & INODE_SNAPSHOT) return -EROFS;
 
   // check permissions for path's inode
   if (target_inode.i_uid == getuid()) {
     if (check_permissions(target_inode.i_mode, S_IRUSR) == 0 || check_permissions(target_inode.i_mode, S_IWUSR) == 0) {
-      printf("User does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "User does not have read/write permissions");
       return -1;
       //exit(1);   
     }
   }
   else if (target_inode.i_gid == getgid()) {
     if (check_permissions(target_inode.i_mode, S_IRGRP) == 0 || check_permissions(target_inode.i_mode, S_IWGRP) == 0) {
-      printf("Group does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Group does not have read/write permissions");
       return -1;
       //exit(1);   
     }
   }
   else {
     if (check_permissions(target_inode.i_mode, S_IROTH) == 0 || check_permissions(target_inode.i_mode, S_IWOTH) == 0) {
-      printf("Other does not have read/write permissions\n");
+      log_msg(LVL_DEBUG, "Other does not have read/write permissions");
       return -1;
       //exit(1);   
     }
@@ -670,7 +2335,7 @@ int make_link(char *path, unsigned int n, char *target)
   
   // 6. add new directory entry to path's parent direcrtory's data block and write it back to disk
   dir[entries].d_inode     = target_parent_index;
-  dir[entries].d_file_type = 1;
+  dir[entries].d_file_type = S_ISLNK(target_inode.i_mode) ? 7 : 1;
   dir[entries].d_name_len  = strlen(prev + 1);
   strcpy(dir[entries].d_name, prev  + 1);
 
@@ -8,28 +8,43 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 
 /* Filesystem layout (based on OSTEP and EXT2)
  * superblock   first block
  * block bitmap 1 block
  * inode bitmap 1 block
- * inode table  5 blocks (total of 8 blocks now)
+ * inode table  5 blocks by default (s_first_data_block - 3 blocks in general)
  * data blocks  1 block each untill end of disk image
  *
  * Notes:
  * The first usable inode is 2.
+ * The bitmaps are one block each, so there are at most BLOCK_SIZE * 8 inodes and data blocks.
  */
 
 #define BLOCK_SIZE       512  /* Old school hardware has 512 bytes per block */
 #define N_INODES         40
 #define START_DATA       8
-#define START_DATA_ADDR  BLOCK_SIZE * 8
+#define START_DATA_ADDR  (BLOCK_SIZE * sb.s_first_data_block)
 #define START_INODE      2
 #define START_INODE_ADDR BLOCK_SIZE * 3
 #define INODE_SIZE       64
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define ITABLE_BLOCKS    (sb.s_first_data_block - 3)
 #define MAX_DIRENT       8
+#define DIRECT_BLOCKS    8
+#define BLOCK_HOLE       0    /* data block 0 always holds the root directory, so in any other inode 0 marks a hole */
 #define MAGIC_SIGN       0x554e4958
 
+#ifndef SEEK_DATA
+#define SEEK_DATA        3    /* Linux values, not visible without _GNU_SOURCE */
+#define SEEK_HOLE        4
+#endif
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 /* Linux value, from <linux/falloc.h> */
+#endif
+
 struct superblock
 {
     uint32_t s_inodes_count; /* total number of inodes (used and free) */
@@ -39,9 +54,28 @@ struct superblock
     uint32_t s_first_data_block; /* which block is the first data block */
     uint32_t s_first_ino; /* index to first inode thats non-reserved */
     uint32_t s_magic;   /* Magic Signature is 0x554e4958 */
+    uint32_t s_log_block_size; /* block size is BLOCK_SIZE << s_log_block_size */
+    uint32_t s_flags;   /* SB_* flags below */
+    uint32_t s_itable_init; /* inode table blocks written so far, if SB_ITABLE_UNINIT */
+    uint32_t s_tail_block; /* tail block that last had room for small files, 0 for none */
+    uint32_t s_refcount_block; /* first block of the block reference count table, 0 for none */
+    uint32_t s_csum_block; /* first block of the checksum table, if SB_METADATA_CSUM */
+    uint32_t s_bitmap_csum[2]; /* checksums of the block and the inode bitmap */
+    uint32_t s_checksum; /* checksum of the superblock up to here */
     /* remaining bytes are unused */
 };
 
+#define SB_ITABLE_UNINIT 0x1 /* inode table blocks from s_itable_init on were never written and read as zeros */
+#define SB_METADATA_CSUM 0x2 /* the superblock, bitmaps, inodes and directory blocks are checksummed */
+#define SB_DATA_CSUM     0x4 /* so are the blocks of files */
+
+/*
+ * Checksums are CRC32C (see crc32c.h). The checksum table holds a uint32_t per inode
+ * followed by one per data block, in blocks in a row from s_csum_block. It is written
+ * along with what it covers and checked the first time each part is read after the image
+ * is opened; the kernel page cache keeps file data from being read twice.
+ */
+
 struct inode
 {
     uint16_t i_mode;          /* File type (S_ISREG or S_ISDIR) and Permissions */
@@ -53,14 +87,61 @@ struct inode
     uint32_t i_ctime;         /* Creation time */
     uint32_t i_mtime;         /* Last modified time */
     uint32_t i_dtime;         /* When was this inode deleted */
-    uint32_t i_blocks;        /* How many blocks are allocated to this file */
+    uint16_t i_blocks;        /* How many blocks are allocated to this file (holes don't count) */
+    uint16_t i_flags;         /* INODE_* flags below */
 
-    uint32_t i_block[8];
+    uint32_t i_block[DIRECT_BLOCKS];
     /* indices to the blocks of data. (which datablock from first)
      * All point to direct blocks
+     * BLOCK_HOLE for parts of a file that were never written, which read as zeros
+     * With INODE_INLINE, the first i_size bytes are the file itself (symlink targets, tiny files)
+     * With INODE_TAIL, the file's slot in a tail block (see TAIL_UNIT)
      * */
 };
 
+#define INODE_EOFBLOCKS 0x1 /* fallocate left blocks allocated past i_size; all of i_block is meaningful */
+#define INODE_INLINE    0x2 /* the file's bytes are stored in i_block itself, zero padded; it has no blocks */
+#define INODE_TAIL      0x4 /* the file's bytes share a tail block with other small files; it has no blocks */
+#define INLINE_MAX      (DIRECT_BLOCKS * 4) /* bytes that fit in i_block */
+
+/*
+ * Tail blocks hold small files in TAIL_UNIT byte slots. The first unit of the block is
+ * a bitmap of the units in use (unit 0 itself included). A tail packed file has
+ * i_block[0] = tail block, i_block[1] = byte offset in it, i_block[2] = bytes reserved
+ */
+#define INODE_COMPRESSED 0x8 /* some clusters of the file may be stored compressed (see CLUSTER_BLOCKS) */
+#define INODE_SNAPSHOT   0x10 /* the inode belongs to a snapshot and is read-only (see SNAPSHOT_DIR) */
+
+#define TAIL_UNIT       32
+#define TAIL_UNITS      (BLOCK_SIZE / TAIL_UNIT)
+#define TAIL_MAX        (BLOCK_SIZE / 2) /* bigger files get blocks of their own */
+
+/*
+ * Compression works on clusters of CLUSTER_BLOCKS block pointers. A compressed cluster is
+ * stored in the blocks its first pointers name, and its remaining pointers are
+ * BLOCK_COMPRESSED. Its first block starts with two uint16s: the compressed and the
+ * uncompressed length. A cluster is only stored compressed if that saves a block.
+ */
+#define CLUSTER_BLOCKS   4
+#define CLUSTER_SIZE     (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define BLOCK_COMPRESSED 0xFFFFFFFF
+
+/*
+ * Files can share data blocks with the same bytes (see dedup_file). The reference count
+ * table has one byte per data block, in s_blocks_count / BLOCK_SIZE blocks in a row from
+ * s_refcount_block: the number of block pointers to it besides the first. A shared block is
+ * copied before it is written in place and only freed when the last pointer lets go of it.
+ * The table is created the first time a block is shared.
+ */
+
+/*
+ * Snapshots live in SNAPSHOT_DIR below the root, one directory per snapshot. A snapshot has
+ * its own copy of every inode and directory block of the tree it was taken from, but shares
+ * the file blocks with it through the reference counts, so it only costs space as the live
+ * tree moves away from it. Everything in it is INODE_SNAPSHOT and can't be changed.
+ */
+#define SNAPSHOT_DIR ".snapshots"
+
 /*
  * A directory should have 2 default entries when starting
  * first: a '.' dir pointing to itself
@@ -70,17 +151,36 @@ struct inode
 struct directory_entry
 {
     uint32_t        d_inode;        /* inode number */
-    uint16_t        d_file_type;    /* 1 for regular file, 2 for directory */
+    uint16_t        d_file_type;    /* 1 for regular file, 2 for directory, 7 for symbolic link */
     uint8_t         d_name_len;     /* length of file name */
     char            d_name[57];     /* file name 0-57 bytes*/
 };
 
+/*
+ * A run of file bytes that are contiguous in the disk image
+ */
+struct extent
+{
+    uint64_t        e_pos;          /* byte offset in the image, 0 for a hole */
+    uint32_t        e_len;          /* number of bytes */
+    uint32_t        e_flags;        /* EXTENT_* flags below */
+};
+
+#define EXTENT_COMPRESSED 0x1 /* the bytes are in compressed clusters; read them with read_file_data */
+
 /*********** HIGH LEVEL FS OPERATIONS ***********/
 // Initialize a filesystem with size specifying number of data blocks at path.
 // real_path is the location of the virtual drive
 // n is the length of the string real_path
 extern void init_filesystem(unsigned int size, char *real_path, unsigned int n);
 
+// Format a sparse filesystem image with size data blocks and the given number of inodes.
+// Only the metadata of the root directory is written; the rest of the inode table is
+// initialized on first use. prealloc reserves the image's space instead of leaving it sparse.
+// features are SB_METADATA_CSUM and SB_DATA_CSUM.
+// Returns 0 or a negative errno.
+extern int format_filesystem(char *real_path, unsigned int n, unsigned int size, unsigned int inodes, int prealloc, int features);
+
 // Open a file system given at path.
 // n is the length of the string real_path
 extern void open_filesystem(char *real_path, unsigned int n);
@@ -94,10 +194,29 @@ extern int make_directory(char *path, unsigned int n);
 // n is the length of the string path
 extern unsigned int read_directory(char *path, unsigned int n, char *data);
 
+// Places up to MAX_DIRENT directory entries in *entries without reading their inodes.
+// Returns the number of entries.
+// n is the length of the string path
+extern int list_directory(char *path, unsigned int n, struct directory_entry *entries);
+
 // Deletes a file in the path
 // n is the length of the string path
 extern int rm_directory(char *path, unsigned int n);
 
+// Delete the directory in the path together with everything below it.
+// The tree is walked by inode number and all frees are written back at once.
+// n is the length of the string path
+extern int rm_tree(char *path, unsigned int n);
+
+// Take a snapshot of everything below the root (except SNAPSHOT_DIR) named "*name".
+// Returns 0 or a negative errno; nothing changes unless there is room for all of it.
+// n is the length of the string name
+extern int make_snapshot(char *name, unsigned int n);
+
+// Delete the snapshot named "*name", freeing what only it was holding on to.
+// n is the length of the string name
+extern int delete_snapshot(char *name, unsigned int n);
+
 // Make a new file of the specified size in the path provided.
 // Initial data has to be passed in
 // file contents are in data
@@ -114,12 +233,102 @@ extern int rm_file (char *path, unsigned int n);
 // n is the length of the string path
 extern unsigned int read_file(char *path, unsigned int n, char *data);
 
+// Map offset..offset+size of a file onto the disk image instead of copying it.
+// Fills at most max extents (adjacent blocks share one) and returns how many were filled.
+// n is the length of the string path
+extern int read_file_map(char *path, unsigned int n, size_t size, off_t offset, struct extent *ext, int max);
+
+// Make room for offset..offset+size in a file, growing it if needed, and map that range
+// onto the disk image so the caller can write the bytes in place.
+// Fills at most max extents and returns how many were filled.
+// n is the length of the string path
+extern int write_file_map(char *path, unsigned int n, size_t size, off_t offset, struct extent *ext, int max);
+
+// Find the next data (whence SEEK_DATA) or hole (whence SEEK_HOLE) at or after offset
+// in a file, like lseek(2). Returns the offset or a negative errno.
+// n is the length of the string path
+extern off_t seek_file(char *path, unsigned int n, off_t offset, int whence);
+
+// Read size bytes at offset of a file into data, decompressing compressed clusters.
+// Returns the number of bytes read or a negative errno.
+// n is the length of the string path
+extern int read_file_data(char *path, unsigned int n, char *data, size_t size, off_t offset);
+
+// Write size bytes of data at offset of a file, storing the clusters it touches compressed
+// where that saves space. Small and preallocated files are written in place instead.
+// Returns the number of bytes written or a negative errno.
+// n is the length of the string path
+extern int write_file_compressed(char *path, unsigned int n, char *data, size_t size, off_t offset);
+
+// Share the blocks of a file that lie wholly in offset..offset+size with blocks of any file
+// that hold the same bytes. Returns the number of blocks freed or a negative errno.
+// n is the length of the string path
+extern int dedup_file(char *path, unsigned int n, off_t offset, size_t size);
+
+// Make len bytes at dst_off of the file at "*to" a copy of the bytes at src_off of the file
+// at "*from" inside the image, sharing whole blocks where it can (len 0: to the source's end).
+// Returns the number of bytes cloned or a negative errno.
+// n and m are the lengths of the strings from and to
+extern int clone_file(char *from, unsigned int n, char *to, unsigned int m, off_t src_off, off_t dst_off, size_t len);
+
+// Check the blocks of a file that hold offset..offset+size against their checksums (with
+// SB_DATA_CSUM). Returns 0, or -EIO if one doesn't match.
+// n is the length of the string path
+extern int verify_file_data(char *path, unsigned int n, off_t offset, size_t size);
+
+// Checksum the blocks that hold offset..offset+size of a file again after they were written
+// in place through the extents of write_file_map (an inline file's inode as well).
+// n is the length of the string path
+extern int update_file_csums(char *path, unsigned int n, off_t offset, size_t size);
+
+// Set the size of a file to size. Shrinking frees the blocks past the new end in one go,
+// growing leaves the new part as a hole.
+// n is the length of the string path
+extern int truncate_file(char *path, unsigned int n, off_t size);
+
+// Allocate blocks for offset..offset+len of a file as one contiguous run where possible,
+// like fallocate(2). mode is 0 or FALLOC_FL_KEEP_SIZE, which leaves the file size alone.
+// n is the length of the string path
+extern int allocate_file(char *path, unsigned int n, int mode, off_t offset, off_t len);
+
+// Move the file or directory at "*from" to "*to", replacing what is there.
+// Only directory entries change; no data is copied.
+// n and m are the lengths of the strings from and to
+extern int rename_path(char *from, unsigned int n, char *to, unsigned int m);
+
 // Make a hard link to the "*target" file at the "*path"
 // n is the length of the string path
 extern int make_link(char *path, unsigned int n, char *target);
 
-// Global vars to keep in memory for performance reasons
-FILE *fp; // The file system image currently in use
-struct superblock sb;
-unsigned char block_bm[BLOCK_SIZE];
-unsigned char inode_bm[BLOCK_SIZE];
+// Make a symbolic link at "*path" that points to "*target". Short targets are kept in the inode.
+// n is the length of the string path
+extern int make_symlink(char *path, unsigned int n, char *target);
+
+// Copy the target of the symbolic link at "*path" into buf (at most size bytes, null terminated)
+// without writing anything back. Returns the target length or a negative errno.
+// n is the length of the string path
+extern int read_symlink(char *path, unsigned int n, char *buf, size_t size);
+
+/*
+ * Running totals since the image was opened, for fusefs to report. Image bytes are counted
+ * as they go through stdio, and an access that doesn't start where the one before it ended
+ * counts as a seek; the checksum cache is the set of inodes and blocks already verified
+ * this mount, and the dedup index the hashes of blocks seen by dedup
+ */
+struct fs_counters {
+    uint64_t bytes_read;      /* image bytes read */
+    uint64_t bytes_written;   /* image bytes written */
+    uint64_t seeks;           /* accesses away from where the last one ended */
+    uint64_t csum_hits;       /* checksums not checked again */
+    uint64_t csum_misses;     /* checksums checked */
+    uint64_t dedup_hits;      /* blocks found in the dedup index and shared */
+    uint64_t dedup_misses;    /* blocks that weren't */
+};
+
+// Global vars to keep in memory for performance reasons (defined in simpleFS.c)
+extern FILE *fp; // The file system image currently in use
+extern struct superblock sb;
+extern unsigned char block_bm[BLOCK_SIZE];
+extern unsigned char inode_bm[BLOCK_SIZE];
+extern unsigned char block_rc[BLOCK_SIZE * 8];
+extern struct fs_counters counters;
@@ -0,0 +1,60 @@
+#include <stdint.h>
+
+/*
+ * Operation traces, written by fusefs -o trace=FILE and replayed by replay_simpleFS.
+ *
+ * A trace is a struct trace_header followed by one struct trace_record per operation, in
+ * the order the operations finished (fusefs runs them one at a time). Each record is
+ * followed by path_len bytes of its path and path2_len bytes of its second path, without
+ * terminating nulls. Numbers are in the byte order of the machine that wrote the trace.
+ */
+#define TRACE_MAGIC   0x45434152545346ULL /* "FSTRACE" */
+#define TRACE_VERSION 1
+
+#define TRACE_F_COMPRESS 0x1 /* the mount had -o compress */
+#define TRACE_F_DEDUP    0x2 /* and -o dedup */
+
+struct trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;       /* TRACE_F_COMPRESS etc. */
+    uint64_t start;       /* CLOCK_REALTIME at the start of the trace, in ns */
+};
+
+enum trace_op {
+    TRACE_GETATTR = 1,
+    TRACE_READDIR,
+    TRACE_MKDIR,
+    TRACE_RMDIR,
+    TRACE_MKNOD,
+    TRACE_UNLINK,
+    TRACE_RENAME,         /* path2 is where path moved to */
+    TRACE_SYMLINK,        /* path is the link, path2 its target */
+    TRACE_READLINK,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_TRUNCATE,
+    TRACE_FALLOCATE,      /* arg is the mode */
+    TRACE_SEEK,           /* SFS_IOC_SEEK: size is the whence */
+    TRACE_DEDUP,          /* SFS_IOC_DEDUP */
+    TRACE_CLONE,          /* SFS_IOC_CLONE: the source is path2 at offset2, size is the length */
+    TRACE_IOCTL,          /* any other ioctl, arg is the command; not replayed */
+    TRACE_OPEN,           /* arg is the open flags; not replayed */
+    TRACE_RELEASE,        /* not replayed */
+    TRACE_OPS
+};
+
+struct trace_record {
+    uint64_t time;        /* when the operation came in, in ns from the start of the trace */
+    uint32_t duration;    /* how long it took, in ns */
+    uint16_t thread;      /* the FUSE thread that ran it, numbered from 0 */
+    uint8_t  op;          /* enum trace_op */
+    uint8_t  pad;
+    int32_t  result;      /* what the operation returned */
+    uint16_t path_len;
+    uint16_t path2_len;
+    int64_t  offset;      /* file offset of reads, writes, fallocate, seeks and clones */
+    int64_t  size;        /* bytes of reads and writes, new size of truncate, length of fallocate */
+    int64_t  offset2;
+    int64_t  arg;
+};
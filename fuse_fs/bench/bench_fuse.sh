@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# bench_fuse.sh [e2e_bench options] [workload ...]
+#
+# Make a scratch image, mount fusefs on a scratch directory and run the e2e_bench workloads
+# on it: once with -s (single threaded) and once multithreaded. Results go to stdout, or to
+# RESULTS if set, one JSON object per line. Needs FUSE (fusermount) and nothing else.
+#
+# Environment: FUSEFS, MKFS and E2E_BENCH name the binaries (built by make bench-fuse),
+# SIZE the image size, FUSE_OPTS the mount options. The kernel's attribute and entry
+# caches are off by default so that every stat reaches the file system.
+#
+set -e
+
+here=$(cd "$(dirname "$0")/.." && pwd)
+FUSEFS=${FUSEFS:-$here/fusefs}
+MKFS=${MKFS:-$here/FilesystemDriver/mkfs_simpleFS}
+E2E_BENCH=${E2E_BENCH:-$here/e2e_bench}
+SIZE=${SIZE:-2M}
+FUSE_OPTS=${FUSE_OPTS:-attr_timeout=0,entry_timeout=0,negative_timeout=0}
+[ -n "$RESULTS" ] && : > "$RESULTS"
+
+for mode in single multi; do
+  dir=$(mktemp -d "${TMPDIR:-/tmp}/simpleFS_e2e.XXXXXX")
+  trap 'fusermount -u "$dir/mnt" 2>/dev/null; rm -rf "$dir"' EXIT INT TERM
+
+  "$MKFS" -s "$SIZE" -i 1024 "$dir/filesystemImage" > /dev/null
+  mkdir "$dir/mnt"
+
+  # fusefs opens ./filesystemImage, so it runs in the scratch directory
+  flags=-f
+  [ $mode = single ] && flags="-f -s"
+  (cd "$dir" && exec "$FUSEFS" $flags -o "$FUSE_OPTS" mnt) > "$dir/fusefs.log" 2>&1 &
+  pid=$!
+
+  tries=0
+  until grep -q " $dir/mnt fuse" /proc/mounts; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ] || ! kill -0 $pid 2>/dev/null; then
+      echo "fusefs did not mount:" >&2
+      tail "$dir/fusefs.log" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+
+  if [ -n "$RESULTS" ]; then
+    "$E2E_BENCH" -m $mode -o "$RESULTS" "$dir/mnt" "$@"
+  else
+    "$E2E_BENCH" -m $mode "$dir/mnt" "$@"
+  fi
+
+  fusermount -u "$dir/mnt"
+  wait $pid
+  rm -rf "$dir"
+  trap - EXIT INT TERM
+done
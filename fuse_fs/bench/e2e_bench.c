@@ -0,0 +1,491 @@
+/*
+ * e2e_bench [-t threads] [-r rounds] [-n ops] [-m mode] [-o results] mountpoint [workload ...]
+ *
+ * Workloads against a mounted simpleFS (or any directory), in this order:
+ *   untar       unpack a generated source tree: mkdir, and create, write and close per file
+ *   stat        threads walk the tree rounds times, lstat-ing every entry (find/stat storm)
+ *   seqwrite_N  threads write their files from start to end in N byte writes
+ *   seqread_N   and read them back, after dropping them from the page cache
+ *   randwrite_N threads write N bytes at random aligned offsets of their files
+ *   randread_N  and read them
+ *   churn       threads create a small file and delete it again, over and over
+ *   rmrf        remove the source tree depth first, like rm -rf
+ * N is each of IO_SIZES. The tree and the files fit simpleFS: at most 6 entries per
+ * directory and files of at most 4K. Each thread works in a directory of its own.
+ * untar, seqwrite and rmrf always run, since the others need what they leave behind.
+ *
+ * Results are written one JSON object per line: throughput in ops and MB per second and
+ * the 50th, 99th and 99.9th percentile latency of an op in microseconds. mode only labels
+ * them (bench_fuse.sh passes single or multi for fusefs -s and multithreaded). On simpleFS
+ * they also have what the workload cost the image, from the totals in mountpoint/.simplefs/stats:
+ * bytes read and written and seeks, and the amplification, the image bytes per byte the file
+ * system was asked to read or write (null for workloads of metadata only).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FILE_MAX     4096 /* biggest file simpleFS holds */
+#define TREE_DEPTH   3    /* levels of directories below the tree's root */
+#define TREE_DIRS    2    /* subdirectories per directory */
+#define TREE_FILES   4    /* files per directory */
+#define IO_FILES     6    /* files per thread for the read and write workloads */
+#define MAX_THREADS  6    /* directories of their own in one directory */
+#define CHURN_SIZE   100
+
+static const int IO_SIZES[] = { 512, 4096 };
+
+// latencies of one workload, in nanoseconds
+struct samples {
+  long long *ns;
+  int n, cap;
+  long long bytes;
+};
+
+// the image I/O totals of simpleFS's stats file
+struct fs_io {
+  unsigned long long logical, read, written, seeks;
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  struct samples s;
+  unsigned int seed;
+  int (*run)(struct worker *w);
+};
+
+static char root[1024];
+static char data[FILE_MAX];
+static int threads = 4, rounds = 3, ops = 2000, io_size;
+static const char *mode = "";
+static FILE *out;
+
+static long long now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void record(struct samples *s, long long start)
+{
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->ns  = realloc(s->ns, sizeof(long long) * s->cap);
+    if (s->ns == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  s->ns[s->n++] = now_ns() - start;
+}
+
+static void fail(const char *what, const char *path)
+{
+  fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+  exit(1);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Read the image I/O totals from root/.simplefs/stats. Returns 0 if there are none (not simpleFS)
+ */
+static int fs_io(struct fs_io *io)
+{
+  char path[1100], line[256];
+  int found = 0;
+
+  snprintf(path, sizeof(path), "%s/.simplefs/stats", root);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return 0;
+
+  memset(io, 0, sizeof(*io));
+  while (fgets(line, sizeof(line), f) != NULL) {
+    found += sscanf(line, "logical_bytes %llu", &io->logical);
+    found += sscanf(line, "image_bytes_read %llu", &io->read);
+    found += sscanf(line, "image_bytes_written %llu", &io->written);
+    found += sscanf(line, "image_seeks %llu", &io->seeks);
+  }
+  fclose(f);
+  return found == 4;
+}
+
+/**
+ * Merge the samples of the workers and write the result line for a workload. io is what the
+ * workload cost the image, or NULL if that isn't known
+ */
+static void report(const char *name, struct worker *w, int count, long long elapsed, struct fs_io *io)
+{
+  struct samples all = { NULL, 0, 0, 0 };
+  int i;
+
+  for (i = 0; i < count; i++) {
+    all.ns = realloc(all.ns, sizeof(long long) * (all.n + w[i].s.n + 1));
+    memcpy(all.ns + all.n, w[i].s.ns, sizeof(long long) * w[i].s.n);
+    all.n     += w[i].s.n;
+    all.bytes += w[i].s.bytes;
+    free(w[i].s.ns);
+    memset(&w[i].s, 0, sizeof(w[i].s));
+  }
+  if (all.n == 0) return;
+
+  qsort(all.ns, all.n, sizeof(long long), cmp_ns);
+  double secs = elapsed / 1e9;
+  fprintf(out, "{\"workload\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"ops\":%d,\"seconds\":%.3f,"
+          "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f",
+          name, mode, count, all.n, secs, all.n / secs, all.bytes / secs / 1e6,
+          all.ns[all.n / 2] / 1e3, all.ns[(long long) all.n * 99 / 100] / 1e3,
+          all.ns[(long long) all.n * 999 / 1000] / 1e3);
+  if (io != NULL) {
+    fprintf(out, ",\"fs_bytes_read\":%llu,\"fs_bytes_written\":%llu,\"fs_seeks\":%llu,\"amplification\":",
+            io->read, io->written, io->seeks);
+    if (io->logical > 0) fprintf(out, "%.2f", (double) (io->read + io->written) / io->logical);
+    else fprintf(out, "null");
+  }
+  fprintf(out, "}\n");
+  fflush(out);
+  free(all.ns);
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  w->run(w);
+  return NULL;
+}
+
+/**
+ * Run fn on count workers at once and report it as one workload
+ */
+static void run_workers(const char *name, int count, int (*fn)(struct worker *w))
+{
+  struct worker w[MAX_THREADS];
+  struct fs_io before, after;
+  int i;
+
+  memset(w, 0, sizeof(w));
+  int have_io = fs_io(&before);
+  long long start = now_ns();
+  for (i = 0; i < count; i++) {
+    w[i].id   = i;
+    w[i].seed = 1 + i;
+    w[i].run  = fn;
+    if (pthread_create(&w[i].thread, NULL, worker_main, &w[i]) != 0) fail("pthread_create", name);
+  }
+  for (i = 0; i < count; i++) pthread_join(w[i].thread, NULL);
+  long long elapsed = now_ns() - start;
+
+  if (have_io && fs_io(&after)) {
+    after.logical -= before.logical;
+    after.read    -= before.read;
+    after.written -= before.written;
+    after.seeks   -= before.seeks;
+    report(name, w, count, elapsed, &after);
+  }
+  else report(name, w, count, elapsed, NULL);
+}
+
+// untar: the tree is made depth first, the way tar lists it
+static void make_tree(struct worker *w, const char *dir, int depth, int *file)
+{
+  char path[4096];
+  int i;
+
+  long long start = now_ns();
+  if (mkdir(dir, 0755) < 0) fail("mkdir", dir);
+  record(&w->s, start);
+
+  for (i = 0; i < TREE_FILES; i++) {
+    int size = 100 + (*file)++ * 397 % (FILE_MAX - 100);
+    snprintf(path, sizeof(path), "%s/file%d.c", dir, i);
+
+    start = now_ns();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, size) != size || close(fd) < 0) fail("write", path);
+    record(&w->s, start);
+    w->s.bytes += size;
+  }
+
+  for (i = 0; depth > 0 && i < TREE_DIRS; i++) {
+    snprintf(path, sizeof(path), "%s/dir%d", dir, i);
+    make_tree(w, path, depth - 1, file);
+  }
+}
+
+static int untar(struct worker *w)
+{
+  char dir[4096];
+  int file = 0;
+
+  snprintf(dir, sizeof(dir), "%s/src", root);
+  make_tree(w, dir, TREE_DEPTH, &file);
+  return 0;
+}
+
+// stat: readdir and lstat every entry, like find -exec stat
+static void walk(struct worker *w, const char *dir)
+{
+  char path[4096];
+  struct dirent *e;
+  DIR *d = opendir(dir);
+  if (d == NULL) fail("opendir", dir);
+
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+
+    struct stat st;
+    long long start = now_ns();
+    if (lstat(path, &st) < 0) fail("lstat", path);
+    record(&w->s, start);
+
+    if (S_ISDIR(st.st_mode)) walk(w, path);
+  }
+  closedir(d);
+}
+
+static int stat_storm(struct worker *w)
+{
+  char dir[4096];
+  int r;
+
+  snprintf(dir, sizeof(dir), "%s/src", root);
+  for (r = 0; r < rounds; r++) walk(w, dir);
+  return 0;
+}
+
+// the read and write workloads use IO_FILES full size files in io/tN
+static void io_path(char *path, size_t len, struct worker *w, int f)
+{
+  snprintf(path, len, "%s/io/t%d/f%d", root, w->id, f);
+}
+
+static int io_open(struct worker *w, int f, int flags)
+{
+  char path[4096];
+  io_path(path, sizeof(path), w, f);
+
+  int fd = open(path, flags, 0644);
+  if (fd < 0) fail("open", path);
+  return fd;
+}
+
+static int seq_write(struct worker *w)
+{
+  int r, f, off;
+
+  for (r = 0; r < rounds; r++) {
+    for (f = 0; f < IO_FILES; f++) {
+      int fd = io_open(w, f, O_WRONLY | O_CREAT);
+      for (off = 0; off < FILE_MAX; off += io_size) {
+        long long start = now_ns();
+        if (pwrite(fd, data + off, io_size, off) != io_size) fail("pwrite", "io");
+        record(&w->s, start);
+        w->s.bytes += io_size;
+      }
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+static int seq_read(struct worker *w)
+{
+  char buf[FILE_MAX];
+  int r, f, off;
+
+  for (r = 0; r < rounds; r++) {
+    for (f = 0; f < IO_FILES; f++) {
+      int fd = io_open(w, f, O_RDONLY);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      for (off = 0; off < FILE_MAX; off += io_size) {
+        long long start = now_ns();
+        if (pread(fd, buf, io_size, off) != io_size) fail("pread", "io");
+        record(&w->s, start);
+        w->s.bytes += io_size;
+      }
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+static int rand_io(struct worker *w, int writing)
+{
+  char buf[FILE_MAX];
+  int fds[IO_FILES], i;
+
+  for (i = 0; i < IO_FILES; i++) fds[i] = io_open(w, i, writing ? O_WRONLY : O_RDONLY);
+
+  for (i = 0; i < ops / threads; i++) {
+    int fd  = fds[rand_r(&w->seed) % IO_FILES];
+    int off = rand_r(&w->seed) % (FILE_MAX / io_size) * io_size;
+    if (!writing) posix_fadvise(fd, off, io_size, POSIX_FADV_DONTNEED);
+
+    long long start = now_ns();
+    ssize_t n = writing ? pwrite(fd, data + off, io_size, off) : pread(fd, buf, io_size, off);
+    if (n != io_size) fail(writing ? "pwrite" : "pread", "io");
+    record(&w->s, start);
+    w->s.bytes += io_size;
+  }
+
+  for (i = 0; i < IO_FILES; i++) close(fds[i]);
+  return 0;
+}
+
+static int rand_write(struct worker *w) { return rand_io(w, 1); }
+static int rand_read(struct worker *w)  { return rand_io(w, 0); }
+
+// churn: one op is a small file created, written, closed and deleted
+static int churn(struct worker *w)
+{
+  char path[4096];
+  int i;
+
+  snprintf(path, sizeof(path), "%s/churn/t%d/f", root, w->id);
+  for (i = 0; i < ops / threads; i++) {
+    long long start = now_ns();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, CHURN_SIZE) != CHURN_SIZE || close(fd) < 0) fail("write", path);
+    if (unlink(path) < 0) fail("unlink", path);
+    record(&w->s, start);
+    w->s.bytes += CHURN_SIZE;
+  }
+  return 0;
+}
+
+// rmrf: nftw has no context argument, so the samples go through a global
+static struct samples *rm_samples;
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  long long start = now_ns();
+  if ((flag == FTW_DP ? rmdir(path) : unlink(path)) < 0) fail("remove", path);
+  record(rm_samples, start);
+  return 0;
+}
+
+static int rmrf(struct worker *w)
+{
+  char dir[4096];
+
+  snprintf(dir, sizeof(dir), "%s/src", root);
+  rm_samples = &w->s;
+  return nftw(dir, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Make a directory for every thread below root/name
+ */
+static void make_thread_dirs(const char *name)
+{
+  char path[4096];
+  int i;
+
+  snprintf(path, sizeof(path), "%s/%s", root, name);
+  if (mkdir(path, 0755) < 0 && errno != EEXIST) fail("mkdir", path);
+  for (i = 0; i < threads; i++) {
+    snprintf(path, sizeof(path), "%s/%s/t%d", root, name, i);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) fail("mkdir", path);
+  }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  return (flag == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+static void usage(char *prog)
+{
+  fprintf(stderr, "usage: %s [-t threads] [-r rounds] [-n ops] [-m mode] [-o results] mountpoint [workload ...]\n", prog);
+  exit(1);
+}
+
+/**
+ * Whether the workload was asked for (all are if none was named)
+ */
+static int wanted(const char *name, int argc, char **argv)
+{
+  int i;
+  if (optind == argc) return 1;
+
+  for (i = optind; i < argc; i++) {
+    size_t len = strlen(argv[i]);
+    if (strncmp(name, argv[i], len) == 0 && (name[len] == '\0' || name[len] == '_')) return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char *out_path = NULL;
+  int opt, i, j;
+
+  while ((opt = getopt(argc, argv, "t:r:n:m:o:")) != -1) {
+    switch (opt) {
+    case 't': threads  = atoi(optarg); break;
+    case 'r': rounds   = atoi(optarg); break;
+    case 'n': ops      = atoi(optarg); break;
+    case 'm': mode     = optarg;       break;
+    case 'o': out_path = optarg;       break;
+    default : usage(argv[0]);
+    }
+  }
+  if (optind >= argc || threads < 1 || threads > MAX_THREADS || rounds < 1 || ops < threads) usage(argv[0]);
+
+  snprintf(root, sizeof(root), "%s", argv[optind++]);
+  out = (out_path != NULL) ? fopen(out_path, "a") : stdout;
+  if (out == NULL) fail("open", out_path);
+  for (i = 0; i < FILE_MAX; i++) data[i] = "int main(void) { return 0; }\n"[i % 30];
+
+  // the tree is needed by stat and rmrf, and the io files by the reads
+  run_workers("untar", 1, untar);
+  if (wanted("stat", argc, argv)) run_workers("stat", threads, stat_storm);
+
+  make_thread_dirs("io");
+  for (j = 0; j < (int) (sizeof(IO_SIZES) / sizeof(IO_SIZES[0])); j++) {
+    char name[32];
+    io_size = IO_SIZES[j];
+
+    snprintf(name, sizeof(name), "seqwrite_%d", io_size);
+    run_workers(name, threads, seq_write);
+    snprintf(name, sizeof(name), "seqread_%d", io_size);
+    if (wanted(name, argc, argv)) run_workers(name, threads, seq_read);
+    snprintf(name, sizeof(name), "randwrite_%d", io_size);
+    if (wanted(name, argc, argv)) run_workers(name, threads, rand_write);
+    snprintf(name, sizeof(name), "randread_%d", io_size);
+    if (wanted(name, argc, argv)) run_workers(name, threads, rand_read);
+  }
+
+  if (wanted("churn", argc, argv)) {
+    make_thread_dirs("churn");
+    run_workers("churn", threads, churn);
+  }
+  run_workers("rmrf", 1, rmrf);
+
+  // leave the mount as it was found
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/io", root);
+  nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  snprintf(path, sizeof(path), "%s/churn", root);
+  nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+  if (out != stdout) fclose(out);
+  return 0;
+}
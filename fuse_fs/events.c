@@ -0,0 +1,171 @@
+#include "FilesystemDriver/events.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct event_ring {
+  uint32_t owner;       /* a thread records here */
+  uint32_t thread;      /* its id */
+  uint64_t head;        /* events recorded; the next goes to ev[head % EVENT_RING_SIZE] */
+  struct event ev[EVENT_RING_SIZE];
+};
+
+static struct event_ring rings[EVENT_RINGS];
+static __thread struct event_ring *my_ring;
+static __thread int no_ring;
+
+static const char *const *op_names;
+static int op_count;
+
+// the names of an event and its arguments; arguments without one aren't printed
+static const struct {
+  const char *name, *a, *b, *c;
+} event_info[EV_TYPES] = {
+  [EV_NONE]            = { "none",            NULL,      NULL,    NULL      },
+  [EV_THREAD]          = { "thread",          "tid",     NULL,    NULL      },
+  [EV_OP]              = { "op",              "op",      "ns",    "bytes"   },
+  [EV_INODE_CSUM_MISS] = { "inode_csum_miss", "inode",   NULL,    NULL      },
+  [EV_BLOCK_CSUM_MISS] = { "block_csum_miss", "block",   NULL,    NULL      },
+  [EV_ALLOC_INODE]     = { "alloc_inode",     "scanned", "inode", NULL      },
+  [EV_ALLOC_BLOCK]     = { "alloc_block",     "scanned", "block", NULL      },
+  [EV_ALLOC_RUN]       = { "alloc_run",       "scanned", "block", "count"   },
+  [EV_FLUSH]           = { "flush",           "bytes",   "ns",    NULL      },
+};
+
+static uint64_t event_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * Take the first free ring for the calling thread, or NULL if there is none
+ */
+static struct event_ring *ring_take()
+{
+  int i;
+
+  for (i = 0; i < EVENT_RINGS; i++) {
+    uint32_t free = 0;
+    if (__atomic_compare_exchange_n(&rings[i].owner, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      my_ring         = &rings[i];
+      my_ring->thread = syscall(SYS_gettid);
+      return my_ring;
+    }
+  }
+
+  no_ring = 1;
+  return NULL;
+}
+
+void event(uint32_t type, uint32_t a, uint32_t b, uint32_t c)
+{
+  struct event_ring *r = my_ring;
+
+  if (r == NULL) {
+    if (no_ring || (r = ring_take()) == NULL) return;
+    event(EV_THREAD, r->thread, 0, 0);
+  }
+
+  uint64_t head   = r->head;
+  struct event *e = &r->ev[head & (EVENT_RING_SIZE - 1)];
+  e->time = event_now();
+  e->type = type;
+  e->a    = a;
+  e->b    = b;
+  e->c    = c;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void event_thread_exit()
+{
+  if (my_ring != NULL) __atomic_store_n(&my_ring->owner, 0, __ATOMIC_RELEASE);
+  my_ring = NULL;
+  no_ring = 0;
+}
+
+void event_op_names(const char *const *names, int n)
+{
+  op_names = names;
+  op_count = n;
+}
+
+// what snprintf would do, without it (it isn't async-signal-safe)
+static char *put_str(char *p, const char *s)
+{
+  while (*s != '\0') *p++ = *s++;
+  return p;
+}
+
+static char *put_u64(char *p, uint64_t v)
+{
+  char digits[20];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  while (n > 0) *p++ = digits[--n];
+  return p;
+}
+
+static char *put_arg(char *p, const char *name, uint32_t v, int is_op)
+{
+  if (name == NULL) return p;
+
+  p = put_str(p, " ");
+  p = put_str(p, name);
+  p = put_str(p, "=");
+  if (is_op && v < (uint32_t) op_count) return put_str(p, op_names[v]);
+  if (v == UINT32_MAX) return put_str(p, "-1");
+  return put_u64(p, v);
+}
+
+/**
+ * Dump the rings a line each: "now NS", then per ring in use "ring R thread TID" followed
+ * by "NS name arg=value..." for its events, oldest first
+ */
+void event_dump(void (*out)(const char *line, size_t len, void *arg), void *arg)
+{
+  struct event copy[EVENT_RING_SIZE];
+  char line[256], *p;
+  int i;
+
+  p = put_u64(put_str(line, "now "), event_now());
+  p = put_str(p, "\n");
+  out(line, p - line, arg);
+
+  for (i = 0; i < EVENT_RINGS; i++) {
+    struct event_ring *r = &rings[i];
+    uint64_t head        = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t first       = (head > EVENT_RING_SIZE) ? head - EVENT_RING_SIZE : 0, n;
+    if (head == 0) continue;
+
+    // the owner may overwrite the oldest events while they are copied; drop what it could have
+    memcpy(copy, r->ev, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    if (now + 1 > first + EVENT_RING_SIZE) first = now + 1 - EVENT_RING_SIZE;
+
+    p = put_u64(put_str(line, "ring "), i);
+    p = put_u64(put_str(p, " thread "), r->thread);
+    p = put_str(p, "\n");
+    out(line, p - line, arg);
+
+    for (n = first; n < head; n++) {
+      struct event *e = &copy[n & (EVENT_RING_SIZE - 1)];
+      if (e->type >= EV_TYPES) continue;
+
+      p = put_u64(line, e->time);
+      p = put_str(put_str(p, " "), event_info[e->type].name);
+      p = put_arg(p, event_info[e->type].a, e->a, e->type == EV_OP);
+      p = put_arg(p, event_info[e->type].b, e->b, 0);
+      p = put_arg(p, event_info[e->type].c, e->c, 0);
+      p = put_str(p, "\n");
+      out(line, p - line, arg);
+    }
+  }
+}
@@ -7,24 +7,443 @@
 
 #include "fusefs.h"
 
-static int sfs_delete(const char *path);
+/*
+ * Mount options, given as -o name
+ *   readdirplus  fill every readdir entry from its inode (batched by inode table block)
+ *                instead of from the directory entry alone
+ *   compress     store the file data written through this mount in compressed clusters;
+ *                compressed files are readable with or without it
+ *   dedup        after each write, share the whole blocks it wrote with blocks of any file
+ *                that hold the same bytes (files can also be deduplicated with SFS_IOC_DEDUP)
+ *   trace=FILE   record every operation in FILE (see FilesystemDriver/trace.h) for
+ *                replay_simpleFS to run again without FUSE
+ *   loglevel=L   log the library's messages up to level L: error, warn (the default),
+ *                info or debug (every refused operation; see FilesystemDriver/log.h)
+ *   logfile=FILE append them to FILE instead of stderr
+ */
+struct sfs_config {
+  int readdirplus;
+  int compress;
+  int dedup;
+  char *trace;
+  char *loglevel;
+  char *logfile;
+};
+
+static struct sfs_config conf;
+
+#define SFS_OPT(t, p, v) { t, offsetof(struct sfs_config, p), v }
+
+static struct fuse_opt sfs_opts[] = {
+  SFS_OPT("readdirplus", readdirplus, 1),
+  SFS_OPT("compress", compress, 1),
+  SFS_OPT("dedup", dedup, 1),
+  SFS_OPT("trace=%s", trace, 0),
+  SFS_OPT("loglevel=%s", loglevel, 0),
+  SFS_OPT("logfile=%s", logfile, 0),
+  FUSE_OPT_END
+};
+
+/*
+ * The library keeps the image's state in globals (fp, sb, the bitmaps) and isn't thread
+ * safe, so every operation holds this lock. Without -s FUSE still takes requests on several
+ * threads, which overlap in the kernel and in FUSE but not in the file system. It is
+ * recursive because some operations call others
+ */
+static pthread_mutex_t sfs_mutex;
+
+/*
+ * The library's counters only move under the lock, so how far they moved while a thread
+ * held it is that thread's image I/O. It adds up in io_done, for the operation under way
+ */
+static __thread int sfs_depth;
+static __thread struct fs_counters io_mark, io_done;
+
+static pthread_mutex_t *sfs_lock(void)
+{
+  pthread_mutex_lock(&sfs_mutex);
+  if (sfs_depth++ == 0) io_mark = counters;
+  return &sfs_mutex;
+}
+
+static void sfs_unlock(pthread_mutex_t **held)
+{
+  if (--sfs_depth == 0) {
+    io_done.bytes_read    += counters.bytes_read - io_mark.bytes_read;
+    io_done.bytes_written += counters.bytes_written - io_mark.bytes_written;
+    io_done.seeks         += counters.seeks - io_mark.seeks;
+  }
+  pthread_mutex_unlock(*held);
+}
+
+// hold the lock until the enclosing function returns
+#define SFS_LOCKED pthread_mutex_t *sfs_held __attribute__((cleanup(sfs_unlock))) = sfs_lock()
+
+static uint64_t sfs_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/*
+ * Latency statistics, served read-only as STATS_FILE. Every operation is timed from entry
+ * to return (waiting for the lock included) into a log-linear histogram: values under
+ * HIST_SUB ns get a bucket each, and every power of two above splits into HIST_SUB
+ * buckets, so a bucket is never more than 25% wide. Each thread counts into a block of
+ * its own, summed up only when the file is read; a thread's block is handed to the next
+ * new thread when it exits, so the counts survive it.
+ *
+ * The image I/O an operation caused is added up next to its latency, with the bytes the
+ * caller asked to read or write; how many image bytes moved per byte asked for is its
+ * amplification
+ */
+#define STATS_DIR    "/.simplefs"
+#define STATS_FILE   STATS_DIR "/stats"
+#define EVENTS_FILE  STATS_DIR "/events"  /* the event rings (see events.h), also dumped to stderr on SIGUSR1 */
+#define HIST_SUB     4
+#define HIST_BUCKETS 128   /* up to 2^33 ns; slower operations go in the last bucket */
+
+enum sfs_op {
+  OP_GETATTR, OP_READDIR, OP_MKDIR, OP_RMDIR, OP_MKNOD, OP_UNLINK, OP_RENAME, OP_SYMLINK,
+  OP_READLINK, OP_OPEN, OP_READ, OP_WRITE, OP_TRUNCATE, OP_FALLOCATE, OP_IOCTL, OP_COUNT
+};
+
+static const char *sfs_op_names[OP_COUNT] = {
+  "getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink", "rename", "symlink",
+  "readlink", "open", "read", "write", "truncate", "fallocate", "ioctl"
+};
+
+struct sfs_thread_stats {
+  uint64_t count[OP_COUNT];
+  uint64_t total_ns[OP_COUNT];
+  uint64_t max_ns[OP_COUNT];
+  uint64_t hist[OP_COUNT][HIST_BUCKETS];
+  uint64_t logical[OP_COUNT];      /* bytes asked for */
+  uint64_t bytes_read[OP_COUNT];   /* image bytes */
+  uint64_t bytes_written[OP_COUNT];
+  uint64_t seeks[OP_COUNT];
+  int      depth;        /* operations of this thread under way; nested ones aren't counted */
+  int      in_use;       /* a live thread owns the block */
+  struct sfs_thread_stats *next;
+};
+
+static struct sfs_thread_stats *stats_threads;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static uint64_t readahead_bytes;   /* image bytes prefetched, under the lock (see sfs_prefetch) */
+static uint64_t inode_prefetch_bytes;  /* and by readdir */
+static __thread struct sfs_thread_stats *my_stats;
+
+static int hist_bucket(uint64_t ns)
+{
+  if (ns < HIST_SUB) return ns;
+
+  int log = 63 - __builtin_clzll(ns);
+  int b   = (log - 1) * HIST_SUB + ((ns >> (log - 2)) & (HIST_SUB - 1));
+  return (b < HIST_BUCKETS) ? b : HIST_BUCKETS - 1;
+}
+
+// the first value past bucket b
+static uint64_t hist_limit(int b)
+{
+  if (b < HIST_SUB) return b + 1;
+
+  int log = b / HIST_SUB + 1;
+  return (uint64_t) (HIST_SUB + b % HIST_SUB + 1) << (log - 2);
+}
+
+static void stats_release(void *block)
+{
+  ((struct sfs_thread_stats *) block)->in_use = 0;
+  event_thread_exit();
+}
+
+static struct sfs_thread_stats *stats_thread(void)
+{
+  if (my_stats != NULL) return my_stats;
+
+  pthread_mutex_lock(&stats_mutex);
+  struct sfs_thread_stats *s;
+  for (s = stats_threads; s != NULL && s->in_use; s = s->next);
+  if (s == NULL && (s = calloc(1, sizeof(struct sfs_thread_stats))) != NULL) {
+    s->next       = stats_threads;
+    stats_threads = s;
+  }
+  if (s != NULL) {
+    s->in_use = 1;
+    pthread_setspecific(stats_key, s);
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  return my_stats = s;
+}
+
+struct sfs_timer {
+  struct sfs_thread_stats *stats;
+  int op;
+  uint64_t logical;
+  uint64_t start;
+};
+
+static struct sfs_timer sfs_time(int op, const char *path, uint64_t logical)
+{
+  PROBE2(op_entry, sfs_op_names[op], path);
+  struct sfs_timer t = { stats_thread(), op, logical, sfs_now() };
+  if (t.stats != NULL && t.stats->depth++ == 0) memset(&io_done, 0, sizeof(io_done));
+  return t;
+}
+
+static void sfs_timed(struct sfs_timer *t)
+{
+  struct sfs_thread_stats *s = t->stats;
+  uint64_t ns = sfs_now() - t->start;
+  PROBE3(op_return, sfs_op_names[t->op], ns, io_done.bytes_read + io_done.bytes_written);
+  if (s == NULL || --s->depth > 0) return;
+
+  s->count[t->op]++;
+  s->total_ns[t->op] += ns;
+  if (ns > s->max_ns[t->op]) s->max_ns[t->op] = ns;
+  s->hist[t->op][hist_bucket(ns)]++;
+
+  s->logical[t->op]       += t->logical;
+  s->bytes_read[t->op]    += io_done.bytes_read;
+  s->bytes_written[t->op] += io_done.bytes_written;
+  s->seeks[t->op]         += io_done.seeks;
+
+  event(EV_OP, t->op, (ns < UINT32_MAX) ? ns : UINT32_MAX - 1, io_done.bytes_read + io_done.bytes_written);
+}
+
+// time the enclosing function as operation op on path, which asks for logical bytes of file data
+#define SFS_TIMED_IO(op, path, logical) struct sfs_timer sfs_timer __attribute__((cleanup(sfs_timed))) = sfs_time(op, path, logical)
+#define SFS_TIMED(op, path)             SFS_TIMED_IO(op, path, 0)
+
+// the files of STATS_DIR
+static int sfs_is_stats_file(const char *path)
+{
+  return strcmp(path, STATS_FILE) == 0 || strcmp(path, EVENTS_FILE) == 0;
+}
+
+static int sfs_is_stats(const char *path)
+{
+  return strcmp(path, STATS_DIR) == 0 || sfs_is_stats_file(path);
+}
+
+// value at fraction q of the histogram h of count values: the end of its bucket, or the
+// largest value if that comes first
+static uint64_t hist_quantile(uint64_t *h, uint64_t count, uint64_t max, double q)
+{
+  uint64_t rank = count * q, seen = 0;
+  int b;
+
+  for (b = 0; b < HIST_BUCKETS - 1; b++) {
+    seen += h[b];
+    if (seen > rank) break;
+  }
+  return (hist_limit(b) < max) ? hist_limit(b) : max;
+}
+
+/*
+ * Print the statistics into a new buffer (the caller frees it) and return its length.
+ * The other threads' counters are read while they may be changing, which can make the
+ * totals off by the operations under way
+ */
+static int stats_render(char **out)
+{
+  static uint64_t hist[OP_COUNT][HIST_BUCKETS];
+  uint64_t count[OP_COUNT] = {0}, total[OP_COUNT] = {0}, max[OP_COUNT] = {0};
+  uint64_t logical[OP_COUNT] = {0}, bytes_read[OP_COUNT] = {0}, bytes_written[OP_COUNT] = {0}, seeks[OP_COUNT] = {0};
+  uint64_t all_logical = 0;
+  struct sfs_thread_stats *s;
+  int op, b;
+
+  pthread_mutex_lock(&stats_mutex);
+  memset(hist, 0, sizeof(hist));
+  for (s = stats_threads; s != NULL; s = s->next) {
+    for (op = 0; op < OP_COUNT; op++) {
+      count[op] += s->count[op];
+      total[op] += s->total_ns[op];
+      if (s->max_ns[op] > max[op]) max[op] = s->max_ns[op];
+      for (b = 0; b < HIST_BUCKETS; b++) hist[op][b] += s->hist[op][b];
+      logical[op]       += s->logical[op];
+      bytes_read[op]    += s->bytes_read[op];
+      bytes_written[op] += s->bytes_written[op];
+      seeks[op]         += s->seeks[op];
+      all_logical       += s->logical[op];
+    }
+  }
+
+  size_t size = 0;
+  FILE *f = open_memstream(out, &size);
+  if (f == NULL) {
+    pthread_mutex_unlock(&stats_mutex);
+    return -ENOMEM;
+  }
+
+  fprintf(f, "%-10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mean_ns", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+  for (op = 0; op < OP_COUNT; op++) {
+    if (count[op] == 0) continue;
+    fprintf(f, "%-10s %10llu %10llu %10llu %10llu %10llu %10llu\n", sfs_op_names[op],
+            (unsigned long long) count[op], (unsigned long long) (total[op] / count[op]),
+            (unsigned long long) hist_quantile(hist[op], count[op], max[op], 0.5),
+            (unsigned long long) hist_quantile(hist[op], count[op], max[op], 0.99),
+            (unsigned long long) hist_quantile(hist[op], count[op], max[op], 0.999), (unsigned long long) max[op]);
+  }
+
+  // image I/O per operation; amplification is image bytes moved per byte asked for
+  fprintf(f, "\n%-10s %14s %14s %14s %10s %13s\n", "io_op", "logical_bytes", "bytes_read", "bytes_written", "seeks", "amplification");
+  for (op = 0; op < OP_COUNT; op++) {
+    if (count[op] == 0) continue;
+    fprintf(f, "%-10s %14llu %14llu %14llu %10llu", sfs_op_names[op], (unsigned long long) logical[op],
+            (unsigned long long) bytes_read[op], (unsigned long long) bytes_written[op], (unsigned long long) seeks[op]);
+    if (logical[op] > 0) fprintf(f, " %13.2f\n", (double) (bytes_read[op] + bytes_written[op]) / logical[op]);
+    else                 fprintf(f, " %13s\n", "-");
+  }
+
+  fprintf(f, "\nlogical_bytes %llu\nimage_bytes_read %llu\nimage_bytes_written %llu\nimage_seeks %llu\nreadahead_bytes %llu\ninode_prefetch_bytes %llu\n"
+             "csum_cache_hits %llu\ncsum_cache_misses %llu\ndedup_hits %llu\ndedup_misses %llu\n",
+          (unsigned long long) all_logical, (unsigned long long) counters.bytes_read,
+          (unsigned long long) counters.bytes_written, (unsigned long long) counters.seeks, (unsigned long long) readahead_bytes,
+          (unsigned long long) inode_prefetch_bytes,
+          (unsigned long long) counters.csum_hits, (unsigned long long) counters.csum_misses,
+          (unsigned long long) counters.dedup_hits, (unsigned long long) counters.dedup_misses);
+
+  // the histograms, as the count of each bucket that has any after the value it ends below
+  fprintf(f, "\n");
+  for (op = 0; op < OP_COUNT; op++) {
+    if (count[op] == 0) continue;
+    fprintf(f, "hist %s", sfs_op_names[op]);
+    for (b = 0; b < HIST_BUCKETS; b++) {
+      if (hist[op][b] != 0) fprintf(f, " %llu:%llu", (unsigned long long) hist_limit(b), (unsigned long long) hist[op][b]);
+    }
+    fprintf(f, "\n");
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  fclose(f);
+  return size;
+}
+
+static void events_out(const char *line, size_t len, void *f)
+{
+  fwrite(line, 1, len, f);
+}
+
+/*
+ * Dump the event rings into a new buffer like stats_render
+ */
+static int events_render(char **out)
+{
+  size_t size = 0;
+  FILE *f = open_memstream(out, &size);
+  if (f == NULL) return -ENOMEM;
+
+  event_dump(events_out, f);
+  fclose(f);
+  return size;
+}
+
+static void events_write(const char *line, size_t len, void *arg)
+{
+  ssize_t res = write(STDERR_FILENO, line, len);
+  (void) res;
+}
+
+static void events_signal(int sig)
+{
+  int saved = errno;
+  event_dump(events_write, NULL);
+  errno = saved;
+}
+
+static int stats_file_render(const char *path, char **out)
+{
+  return (strcmp(path, EVENTS_FILE) == 0) ? events_render(out) : stats_render(out);
+}
+
+static int sfs_stats_stat(const char *path, struct stat *stbuf)
+{
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_uid   = getuid();
+  stbuf->st_gid   = getgid();
+  stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+
+  if (strcmp(path, STATS_DIR) == 0) {
+    stbuf->st_mode  = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  char *text;
+  int len = stats_file_render(path, &text);
+  if (len < 0) return len;
+  free(text);
+
+  stbuf->st_mode  = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+  stbuf->st_size  = len;
+  return 0;
+}
+
+static int sfs_stats_read(const char *path, char *buf, size_t size, off_t offset)
+{
+  char *text;
+  int len = stats_file_render(path, &text);
+  if (len < 0) return len;
+
+  if (offset >= len) size = 0;
+  else if (offset + size > (size_t) len) size = len - offset;
+  memcpy(buf, text + offset, size);
+
+  free(text);
+  return size;
+}
 
 static void *sfs_mount(struct fuse_conn_info *conn) {
   
+  // the writer thread has to start after FUSE forked into the background
+  int res = log_start(conf.logfile);
+  if (res < 0) fprintf(stderr, "can't log to %s: %s\n", conf.logfile ? conf.logfile : "stderr", strerror(-res));
   open_filesystem("./filesystemImage", strlen("./filesystemImage"));
 
-  if (fp == NULL) exit(1);
-  
+  if (fp == NULL) {
+    log_stop();
+    exit(1);
+  }
+
+  // let the kernel splice file data between /dev/fuse and the image instead of copying it through us
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ);
   return NULL;
 }
 
+static FILE *trace_fp;
+
 static void sfs_unmount (void *private_data) {
   fclose(fp);
+  if (trace_fp != NULL) fclose(trace_fp);
+  log_stop();
 }
 
+static void sfs_fill_stat(struct stat *stbuf, struct inode *node)
+{
+  stbuf->st_mode   = node->i_mode;
+  if (node->i_flags & INODE_SNAPSHOT) stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+  stbuf->st_nlink  = node->i_links_count;
+  stbuf->st_uid    = node->i_uid;
+  stbuf->st_gid    = node->i_gid;
+  stbuf->st_size   = node->i_size;
+  stbuf->st_blocks = node->i_blocks;
+  stbuf->st_atime  = node->i_time;
+  stbuf->st_mtime  = node->i_mtime;
+  stbuf->st_ctime  = node->i_ctime;
+}
 
  static int sfs_getattr(const char *path, struct stat *stbuf)
 {
+  SFS_TIMED(OP_GETATTR, path);
+  SFS_LOCKED;
+  if (sfs_is_stats(path)) return sfs_stats_stat(path, stbuf);
+
   int parent_inode_num = validate_path((char *) path, 3);
 
   if (parent_inode_num < 0) {
@@ -34,22 +453,31 @@ static void sfs_unmount (void *private_data) {
 
   struct inode node;
   read_inode(&node, parent_inode_num);
-  stbuf->st_mode   = node.i_mode;
-  stbuf->st_nlink  = node.i_links_count;
-  stbuf->st_uid    = node.i_uid;
-  stbuf->st_gid    = node.i_gid;
-  stbuf->st_size   = node.i_size;
-  stbuf->st_blocks = node.i_blocks;
-  stbuf->st_atime  = node.i_time;
-  stbuf->st_mtime  = node.i_mtime;
-  stbuf->st_ctime  = node.i_ctime;
+  sfs_fill_stat(stbuf, &node);
   
   return 0;
 }
 
+/*
+ * The name of the snapshot that path is, if it names an entry of SNAPSHOT_DIR.
+ * Making and removing such a directory takes and deletes a snapshot
+ */
+static const char *sfs_snapshot_name(const char *path)
+{
+  size_t len = strlen("/" SNAPSHOT_DIR "/");
+
+  if (strncmp(path, "/" SNAPSHOT_DIR "/", len) != 0 || strchr(path + len, '/') != NULL) return NULL;
+  return path + len;
+}
+
 static int sfs_mkdir(const char *path, mode_t mode)
 {
-  int result = make_directory((char *) path, strlen(path));
+  SFS_TIMED(OP_MKDIR, path);
+  SFS_LOCKED;
+  if (sfs_is_stats(path)) return -EPERM;
+  const char *snap = sfs_snapshot_name(path);
+  int result = (snap != NULL) ? make_snapshot((char *) snap, strlen(snap))
+                              : make_directory((char *) path, strlen(path));
 
   if (result < 0) {
     errno = -result;
@@ -60,37 +488,69 @@ static int sfs_mkdir(const char *path, mode_t mode)
 }
 
 
+static int sfs_cookie_cmp(const void *a, const void *b)
+{
+  uint32_t ca = dirent_cookie((struct directory_entry *) a);
+  uint32_t cb = dirent_cookie((struct directory_entry *) b);
+
+  return (ca > cb) - (ca < cb);
+}
+
 static int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,off_t offset, struct fuse_file_info *fi)
 {
-  char *data = (char *) malloc(BLOCK_SIZE);
-  int bytes_read = read_directory((char *) path, strlen(path), data);
+  SFS_TIMED(OP_READDIR, path);
+  SFS_LOCKED;
+  if (strcmp(path, STATS_DIR) == 0) {
+    if (offset < 1) filler(buf, ".", NULL, 1);
+    if (offset < 2) filler(buf, "..", NULL, 2);
+    if (offset < 3) filler(buf, STATS_FILE + strlen(STATS_DIR "/"), NULL, 3);
+    if (offset < 4) filler(buf, EVENTS_FILE + strlen(STATS_DIR "/"), NULL, 4);
+    return 0;
+  }
 
-  if (bytes_read < 0) {
-    errno = -bytes_read;
+  struct directory_entry dirents[MAX_DIRENT];
+  int n = list_directory((char *) path, strlen(path), dirents), i = 0;
+
+  if (n < 0) {
+    errno = -n;
     return -errno;
   }
-  
-  int n = bytes_read / sizeof(struct directory_entry), i = 0;
-  struct directory_entry dirents[n];
-  memcpy(dirents, data, bytes_read);
-  
-  while (i < n) {
+
+  // hand entries out in cookie order, so a listing resumed at offset picks up where it stopped
+  qsort(dirents, n, sizeof(struct directory_entry), sfs_cookie_cmp);
+
+  // with readdirplus the inodes are read now; without, getattr will come for each name
+  // right after, so the inode table blocks are set to be read in the background
+  struct inode nodes[MAX_DIRENT];
+  uint32_t index[MAX_DIRENT];
+  for (i = 0; i < n; i++) index[i] = dirents[i].d_inode;
+  if (conf.readdirplus) read_inodes(nodes, index, n);
+  else                  inode_prefetch_bytes += prefetch_inodes(index, n);
+
+  for (i = 0; i < n; i++) {
+    uint32_t cookie = dirent_cookie(&dirents[i]);
+    if (cookie <= offset) continue;
+
     struct stat st;
-    struct inode node;
-    read_inode(&node, dirents[i].d_inode);
     memset(&st, 0, sizeof(st));
-    st.st_ino  = dirents[i].d_inode;
-    st.st_mode = node.i_mode;
-    if (filler(buf, dirents[i++].d_name, &st, 0)) break;
+    st.st_ino = dirents[i].d_inode;
+    if (conf.readdirplus)               sfs_fill_stat(&st, &nodes[i]);
+    else if (dirents[i].d_file_type == 2) st.st_mode = S_IFDIR;
+    else if (dirents[i].d_file_type == 7) st.st_mode = S_IFLNK;
+    else                                st.st_mode = S_IFREG;
+
+    if (filler(buf, dirents[i].d_name, &st, cookie)) break;
   }
 
-  free(data);
   return 0;
 }
 
 
 static int sfs_create(const char *path, mode_t mode, dev_t rdev)
 {
+  SFS_TIMED(OP_MKNOD, path);
+  SFS_LOCKED;
+  if (sfs_is_stats(path)) return -EPERM;
   int result = create_file((char *) path, strlen(path), 0, NULL);
 
   if (result < 0) {
@@ -102,91 +562,421 @@ static int sfs_create(const char *path, mode_t mode, dev_t rdev)
 }
 
 
-static int sfs_read(const char *path, char *buf, size_t size, off_t offset,struct fuse_file_info *fi)
+static int sfs_read_data(const char *path, char *buf, size_t size, off_t offset)
 {
-  int bytes_read = read_file((char *) path, strlen(path), buf);
+  int bytes_read = read_file_data((char *) path, strlen(path), buf, size, offset);
 
   if (bytes_read < 0) {
     errno = -bytes_read;
     return -errno;
   }
+
+  return bytes_read;
+}
+
+/*
+ * With data checksums, the blocks under a read are checked before they are handed out.
+ * Reads only get here on a page cache miss, and each block is checked once per mount
+ */
+static int sfs_verify(const char *path, size_t size, off_t offset)
+{
+  if ((sb.s_flags & SB_DATA_CSUM) == 0) return 0;
+
+  int result = verify_file_data((char *) path, strlen(path), offset, size);
+  if (result < 0) {
+    errno = -result;
+    return -errno;
+  }
+
+  return 0;
+}
+
+/*
+ * Readahead: each open file remembers where a sequential read would go on. A read that
+ * starts there doubles the window (from RA_MIN up to RA_MAX blocks), any other halves it,
+ * and the window's worth of the file past the read is mapped with it. posix_fadvise asks
+ * the kernel to bring those blocks of the image into its page cache in the background,
+ * so the next read finds them there. What was asked for once isn't asked for again
+ */
+#define RA_MIN 2
+#define RA_MAX DIRECT_BLOCKS  /* a whole file */
+
+struct sfs_file {
+  off_t next;           /* where the last read ended */
+  off_t ahead;          /* where the prefetched part of the file ends */
+  int   window;         /* blocks to prefetch past a read */
+};
+
+/**
+ * How many bytes past a read of size bytes at offset to map for readahead
+ */
+static size_t sfs_ahead(struct fuse_file_info *fi, off_t offset, size_t size)
+{
+  struct sfs_file *f = (fi != NULL) ? (struct sfs_file *) (uintptr_t) fi->fh : NULL;
+  if (f == NULL) return 0;
+
+  if (offset == f->next) f->window = (f->window == 0) ? RA_MIN : (f->window * 2 < RA_MAX) ? f->window * 2 : RA_MAX;
+  else                   f->window /= 2;
+  f->next = offset + size;
+
+  return f->window * BLOCK_SIZE;
+}
+
+/**
+ * Cut the n extents mapped for a read of size bytes at offset back to the read, and
+ * prefetch what is past it. Returns how many extents the read has
+ */
+static int sfs_prefetch(struct fuse_file_info *fi, off_t offset, size_t size, struct extent *ext, int n)
+{
+  struct sfs_file *f = (fi != NULL) ? (struct sfs_file *) (uintptr_t) fi->fh : NULL;
+  size_t done = 0;
+  int i, keep = n;
+
+  for (i = 0; i < n; i++) {
+    struct extent past = ext[i];
+    if (done < size) {
+      if (done + ext[i].e_len <= size) {
+        done += ext[i].e_len;
+        continue;
+      }
+      // the extent goes on past the read
+      past.e_len     -= size - done;
+      if (past.e_pos != 0) past.e_pos += size - done;
+      ext[i].e_len    = size - done;
+      done            = size;
+      keep            = i + 1;
+    }
+    else if (keep == n) keep = i;
+
+    // only data stored plainly, and only once
+    off_t at  = offset + done;
+    done     += past.e_len;
+    if (f == NULL || past.e_pos == 0 || (past.e_flags & EXTENT_COMPRESSED) || at + past.e_len <= f->ahead) continue;
+    if (at < f->ahead) {
+      past.e_pos += f->ahead - at;
+      past.e_len -= f->ahead - at;
+    }
+    posix_fadvise(fileno(fp), past.e_pos, past.e_len, POSIX_FADV_WILLNEED);
+    readahead_bytes += past.e_len;
+    f->ahead = offset + done;
+  }
+
+  return keep;
+}
+
+/*
+ * Files get their readahead state. The statistics and events change between reads, so
+ * their files are read with direct I/O
+ */
+static int sfs_open(const char *path, struct fuse_file_info *fi)
+{
+  SFS_TIMED(OP_OPEN, path);
+  if (!sfs_is_stats_file(path)) {
+    struct sfs_file *f = calloc(1, sizeof(struct sfs_file));
+    if (f == NULL) return -ENOMEM;
+
+    fi->fh = (uintptr_t) f;
+    return 0;
+  }
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+  fi->direct_io = 1;
+  return 0;
+}
+
+static int sfs_release(const char *path, struct fuse_file_info *fi)
+{
+  free((struct sfs_file *) (uintptr_t) fi->fh);
+  return 0;
+}
+
+static int sfs_read(const char *path, char *buf, size_t size, off_t offset,struct fuse_file_info *fi)
+{
+  SFS_TIMED_IO(OP_READ, path, sfs_is_stats(path) ? 0 : size);
+  SFS_LOCKED;
+  if (sfs_is_stats_file(path)) return sfs_stats_read(path, buf, size, offset);
+
+  struct extent ext[DIRECT_BLOCKS];
+  int n = sfs_verify(path, size, offset), i;
+  if (n < 0) return n;
+
+  n = read_file_map((char *) path, strlen(path), size + sfs_ahead(fi, offset, size), offset, ext, DIRECT_BLOCKS);
+
+  if (n < 0) {
+    errno = -n;
+    return -errno;
+  }
+  n = sfs_prefetch(fi, offset, size, ext, n);
+
+  // compressed clusters can't be read in place
+  for (i = 0; i < n; i++) {
+    if (ext[i].e_flags & EXTENT_COMPRESSED) return sfs_read_data(path, buf, size, offset);
+  }
+
+  image_flush();
+  int bytes_read = 0;
+  for (i = 0; i < n; i++) {
+    ssize_t res = ext[i].e_len;
+    if (ext[i].e_pos == 0) memset(buf + bytes_read, 0, ext[i].e_len);
+    else                   res = pread(fileno(fp), buf + bytes_read, ext[i].e_len, ext[i].e_pos);
+    if (res < 0) return -errno;
+    if (ext[i].e_pos != 0) {
+      image_access(ext[i].e_pos, res);
+      counters.bytes_read += res;
+    }
+    bytes_read += res;
+  }
   
   return bytes_read;
 }
 
+/*
+ * Hand out what read puts in memory, for data that can't be spliced from the image
+ */
+static int sfs_read_mem(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                        int (*read)(const char *, char *, size_t, off_t))
+{
+  struct fuse_bufvec *mem = malloc(sizeof(struct fuse_bufvec));
+  char *data              = malloc(size);
+  int res                 = (mem == NULL || data == NULL) ? -ENOMEM : read(path, data, size, offset);
+  if (res < 0) {
+    free(mem);
+    free(data);
+    return res;
+  }
+
+  *mem            = FUSE_BUFVEC_INIT(res);
+  mem->buf[0].mem = data;
+  *bufp           = mem;
+  return 0;
+}
+
+/*
+ * Zero-copy read: hand libfuse (image fd, offset) pairs for the contiguous runs of the
+ * file so it can splice them from the image straight into /dev/fuse
+ */
+static int sfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  SFS_TIMED_IO(OP_READ, path, sfs_is_stats(path) ? 0 : size);
+  SFS_LOCKED;
+  if (sfs_is_stats_file(path)) return sfs_read_mem(path, bufp, size, offset, sfs_stats_read);
+
+  struct extent ext[DIRECT_BLOCKS];
+  int n = sfs_verify(path, size, offset), i;
+  if (n < 0) return n;
+
+  n = read_file_map((char *) path, strlen(path), size + sfs_ahead(fi, offset, size), offset, ext, DIRECT_BLOCKS);
+
+  if (n < 0) {
+    errno = -n;
+    return -errno;
+  }
+  n = sfs_prefetch(fi, offset, size, ext, n);
+
+  // compressed clusters are decompressed into one memory buffer
+  for (i = 0; i < n; i++) {
+    if (ext[i].e_flags & EXTENT_COMPRESSED) return sfs_read_mem(path, bufp, size, offset, sfs_read_data);
+  }
+
+  struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * (n > 0 ? n - 1 : 0));
+  if (src == NULL) return -ENOMEM;
+
+  *src = FUSE_BUFVEC_INIT(0);
+  if (n > 0) src->count = n;
+
+  // data written through fp may still sit in its buffer
+  image_flush();
+  for (i = 0; i < n; i++) {
+    src->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src->buf[i].fd    = fileno(fp);
+    src->buf[i].pos   = ext[i].e_pos;
+    src->buf[i].size  = ext[i].e_len;
+    src->buf[i].mem   = NULL;
+
+    // holes come from memory; libfuse frees mem after the reply
+    if (ext[i].e_pos == 0) {
+      src->buf[i].flags = 0;
+      src->buf[i].fd    = -1;
+      src->buf[i].mem   = calloc(1, ext[i].e_len);
+      if (src->buf[i].mem == NULL) {
+        while (i-- > 0) free(src->buf[i].mem);
+        free(src);
+        return -ENOMEM;
+      }
+    }
+    else {
+      image_access(ext[i].e_pos, ext[i].e_len);
+      counters.bytes_read += ext[i].e_len;
+    }
+  }
+
+  *bufp = src;
+  return 0;
+}
+
+
+/*
+ * Bytes written in place through write_file_map extents get their checksums from what
+ * landed on disk; the library can't see them go by
+ */
+static void sfs_csum_written(const char *path, off_t offset, int written)
+{
+  if ((sb.s_flags & SB_METADATA_CSUM) && written > 0) update_file_csums((char *) path, strlen(path), offset, written);
+}
+
+/*
+ * Inline dedup (-o dedup): once a write is on disk, the whole blocks it covered are shared
+ * with identical blocks elsewhere. A failure here leaves the data unshared, not lost
+ */
+static void sfs_dedup_written(const char *path, off_t offset, int written)
+{
+  if (conf.dedup && written > 0) dedup_file((char *) path, strlen(path), offset, written);
+}
 
 static int sfs_write(const char *path, const char *buf, size_t size,
                      off_t offset, struct fuse_file_info *fi)
 {
-  int parent_inode_num = validate_path((char *) path, 3);
+  SFS_TIMED_IO(OP_WRITE, path, size);
+  SFS_LOCKED;
+  if (conf.compress) {
+    int bytes_written = write_file_compressed((char *) path, strlen(path), (char *) buf, size, offset);
 
-  if (parent_inode_num == -1) {
-    errno = ENOTDIR;
-    return -errno;
+    if (bytes_written < 0) {
+      errno = -bytes_written;
+      return -errno;
+    }
+    sfs_dedup_written(path, offset, bytes_written);
+    return bytes_written;
   }
 
-  if (parent_inode_num == -2) {
-    errno = ENOENT;
+  struct extent ext[DIRECT_BLOCKS];
+  int n = write_file_map((char *) path, strlen(path), size, offset, ext, DIRECT_BLOCKS), i;
+
+  if (n < 0) {
+    errno = -n;
     return -errno;
   }
 
-  struct inode node;
-  read_inode(&node, parent_inode_num);
-  node.i_size += size;
-  write_inode(&node, parent_inode_num);
-  
-  char *temp = create_path((char *)buf, size);
-  int i = 0;
-  for (i = 0; i < node.i_blocks - 1; i++) {
-    write_data(temp, node.i_block[i], BLOCK_SIZE);
-    temp += BLOCK_SIZE;
-  }
-  if (size % BLOCK_SIZE != 0) write_data(temp, node.i_block[i], size % BLOCK_SIZE);
-  else                        write_data(temp, node.i_block[i], size);
+  image_flush();
+  int bytes_written = 0;
+  for (i = 0; i < n; i++) {
+    ssize_t res = pwrite(fileno(fp), buf + bytes_written, ext[i].e_len, ext[i].e_pos);
+    if (res < 0) return -errno;
+    image_access(ext[i].e_pos, res);
+    bytes_written += res;
+  }
+  counters.bytes_written += bytes_written;
+  // drop anything fp buffered from the blocks we just wrote
+  image_flush();
+  sfs_csum_written(path, offset, bytes_written);
+  sfs_dedup_written(path, offset, bytes_written);
   
-  return size;
+  return bytes_written;
 }
 
-static int sfs_remove_dir(const char *path) 
+/*
+ * Zero-copy write: the kernel's buffers go straight to the image offsets the file
+ * was given. Blocks new to the file are zeroed when allocated, so edge blocks are
+ * written in place as well instead of being padded in memory first
+ */
+static int sfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
 {
-  char *copy = strdup(path);
-  int parent_inode_num = validate_path(copy, 3);
+  SFS_TIMED_IO(OP_WRITE, path, fuse_buf_size(buf));
+  SFS_LOCKED;
+  size_t size = fuse_buf_size(buf);
 
-  if (parent_inode_num == -1) {
-    errno = ENOTDIR;
-    return -errno;
+  // compression needs the bytes in memory
+  if (conf.compress) {
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+    char *data = malloc(size);
+    if (data == NULL) return -ENOMEM;
+
+    mem.buf[0].mem = data;
+    ssize_t res    = fuse_buf_copy(&mem, buf, 0);
+    if (res >= 0) res = sfs_write(path, data, res, offset, fi);
+
+    free(data);
+    return res;
   }
 
-  if (parent_inode_num == -2) {
-    errno = ENOENT;
+  struct extent ext[DIRECT_BLOCKS];
+  int n = write_file_map((char *) path, strlen(path), size, offset, ext, DIRECT_BLOCKS), i;
+
+  if (n < 0) {
+    errno = -n;
     return -errno;
   }
 
-  struct inode node;
-  read_inode(&node, parent_inode_num);
+  struct fuse_bufvec *dst = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * (n > 0 ? n - 1 : 0));
+  if (dst == NULL) return -ENOMEM;
 
-  int n = node.i_size / sizeof(struct directory_entry), i = 0, res;
-  if (n > 2) {
-    struct directory_entry entries[8];
-    read_direntry(entries, node.i_block[0], n);
+  *dst = FUSE_BUFVEC_INIT(0);
+  if (n > 0) dst->count = n;
 
-    for (i = 2; i < n; i++) {
-      char new_path[strlen(path) + strlen(entries[i].d_name) + 2];
-      strcpy(new_path, path);
-      if (*(path + strlen(path) - 1) != '/') strcat(new_path, "/");
-      strcat(new_path, entries[i].d_name);
+  for (i = 0; i < n; i++) {
+    dst->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst->buf[i].fd    = fileno(fp);
+    dst->buf[i].pos   = ext[i].e_pos;
+    dst->buf[i].size  = ext[i].e_len;
+    dst->buf[i].mem   = NULL;
+  }
 
-      if (entries[i].d_file_type == 2) res = sfs_remove_dir(new_path);
-      else                             res = sfs_delete(new_path);
+  image_flush();
+  ssize_t res = fuse_buf_copy(dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+  image_flush();
+  if (res > 0) counters.bytes_written += res;
+  for (i = 0; i < n; i++) image_access(ext[i].e_pos, ext[i].e_len);
+  sfs_csum_written(path, offset, res);
+  sfs_dedup_written(path, offset, res);
 
-      if (res != 0) {
-	errno = -res;
-	return -errno;
-      }
-    }
+  free(dst);
+  return res;
+}
+
+static int sfs_truncate(const char *path, off_t size)
+{
+  SFS_TIMED(OP_TRUNCATE, path);
+  SFS_LOCKED;
+  if (sfs_is_stats(path)) return -EPERM;
+  int result = truncate_file((char *) path, strlen(path), size);
+
+  if (result < 0) {
+    errno = -result;
+    return -errno;
   }
 
-  int result = rm_directory((char *) path, strlen(path));
+  return 0;
+}
+
+static int sfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+  SFS_TIMED(OP_TRUNCATE, path);
+  SFS_LOCKED;
+  return sfs_truncate(path, size);
+}
+
+static int sfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+{
+  SFS_TIMED(OP_FALLOCATE, path);
+  SFS_LOCKED;
+  int result = allocate_file((char *) path, strlen(path), mode, offset, len);
+
+  if (result < 0) {
+    errno = -result;
+    return -errno;
+  }
+
+  return 0;
+}
+
+static int sfs_remove_dir(const char *path) 
+{
+  SFS_TIMED(OP_RMDIR, path);
+  SFS_LOCKED;
+  if (sfs_is_stats(path)) return -EPERM;
+  const char *snap = sfs_snapshot_name(path);
+  int result = (snap != NULL) ? delete_snapshot((char *) snap, strlen(snap))
+                              : rm_tree((char *) path, strlen(path));
 
   if (result < 0) {
     errno = -result;
@@ -198,6 +988,9 @@ static int sfs_remove_dir(const char *path)
 
 static int sfs_delete(const char *path) 
 {
+  SFS_TIMED(OP_UNLINK, path);
+  SFS_LOCKED;
+  if (sfs_is_stats(path)) return -EPERM;
   int result = rm_file((char *) path, strlen(path));
 
   if (result < 0) {
@@ -208,59 +1001,362 @@ static int sfs_delete(const char *path)
   return 0;
 }
 
-static int sfs_symlink(const char *from, const char *to) 
+static int sfs_rename(const char *from, const char *to)
 {
-  int result = create_file((char *) to, strlen(to), strlen(from), (char *) from);
+  SFS_TIMED(OP_RENAME, from);
+  SFS_LOCKED;
+  if (sfs_is_stats(from) || sfs_is_stats(to)) return -EPERM;
+  int result = rename_path((char *) from, strlen(from), (char *) to, strlen(to));
 
   if (result < 0) {
     errno = -result;
     return -errno;
   }
-  
-  int inum = validate_path(strdup(to), 3);
 
-  struct inode node;
-  read_inode(&node, inum);
-  node.i_mode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
+  return 0;
+}
 
-  write_inode(&node, inum);
+static int sfs_symlink(const char *from, const char *to) 
+{
+  SFS_TIMED(OP_SYMLINK, to);
+  SFS_LOCKED;
+  if (sfs_is_stats(to)) return -EPERM;
+  int result = make_symlink((char *) to, strlen(to), (char *) from);
+
+  if (result < 0) {
+    errno = -result;
+    return -errno;
+  }
   
   return 0;
 }
 
 static int sfs_readlink(const char *path, char *buf, size_t size)
 {
-  int bytes_read  = read_file((char *) path, strlen(path), buf);
+  SFS_TIMED(OP_READLINK, path);
+  SFS_LOCKED;
+  int bytes_read  = read_symlink((char *) path, strlen(path), buf, size);
 
   if (bytes_read < 0) {
     errno = -bytes_read;
     return -errno;
   }
-  buf[bytes_read] = '\0';
   
   return 0;
 }
 
 
 
+static int sfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+  SFS_TIMED(OP_IOCTL, path);
+  SFS_LOCKED;
+  if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+
+  switch ((unsigned int) cmd) {
+  case SFS_IOC_SEEK: {
+    struct sfs_seek *req = data;
+    off_t result = seek_file((char *) path, strlen(path), req->offset, req->whence);
+
+    if (result < 0) {
+      errno = -result;
+      return -errno;
+    }
+
+    req->offset = result;
+    return 0;
+  }
+  case SFS_IOC_DEDUP: {
+    int result = dedup_file((char *) path, strlen(path), 0, DIRECT_BLOCKS * BLOCK_SIZE);
+
+    if (result < 0) {
+      errno = -result;
+      return -errno;
+    }
+
+    *(int32_t *) data = result;
+    return 0;
+  }
+  case SFS_IOC_CLONE: {
+    struct sfs_clone *req = data;
+    req->src[sizeof(req->src) - 1] = '\0';
+    if (req->src[0] != '/' || req->src_offset < 0 || req->dst_offset < 0 || req->length < 0) return -EINVAL;
+
+    int result = clone_file(req->src, strlen(req->src), (char *) path, strlen(path),
+                            req->src_offset, req->dst_offset, req->length);
+
+    if (result < 0) {
+      errno = -result;
+      return -errno;
+    }
+
+    req->length = result;
+    return 0;
+  }
+  }
+
+  return -ENOTTY;
+}
+
+/*
+ * Tracing (-o trace=FILE). FUSE calls each operation through its trace_ wrapper, which
+ * appends it to the trace when it returns, with its arguments, its result and how long it
+ * took; without a trace the wrappers just call the handler. The path is copied first
+ * because some operations cut it up in place
+ */
+static uint64_t trace_start;
+static int trace_threads;
+static __thread int trace_thread = -1;
+
+#define TRACE_BEGIN(path)                                                \
+  uint64_t t0 = 0;                                                       \
+  char tpath[(trace_fp != NULL) ? strlen(path) + 1 : 1];                 \
+  if (trace_fp != NULL) {                                                \
+    t0 = sfs_now();                                                      \
+    strcpy(tpath, path);                                                 \
+  }
+
+static int sfs_trace(int op, const char *path, const char *path2, int64_t offset, int64_t size,
+                     int64_t offset2, int64_t arg, uint64_t start, int result)
+{
+  if (trace_fp == NULL) return result;
+
+  SFS_LOCKED;
+  if (sfs_is_stats(path)) return result;
+  if (trace_thread < 0) trace_thread = trace_threads++;
+
+  struct trace_record rec = {
+    .time = start - trace_start, .duration = sfs_now() - start, .thread = trace_thread, .op = op,
+    .result = result, .path_len = strlen(path), .path2_len = (path2 != NULL) ? strlen(path2) : 0,
+    .offset = offset, .size = size, .offset2 = offset2, .arg = arg
+  };
+  fwrite(&rec, sizeof(rec), 1, trace_fp);
+  fwrite(path, 1, rec.path_len, trace_fp);
+  if (path2 != NULL) fwrite(path2, 1, rec.path2_len, trace_fp);
+
+  return result;
+}
+
+static int trace_getattr(const char *path, struct stat *stbuf)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_GETATTR, tpath, NULL, 0, 0, 0, 0, t0, sfs_getattr(path, stbuf));
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_MKDIR, tpath, NULL, 0, 0, 0, mode, t0, sfs_mkdir(path, mode));
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_READDIR, tpath, NULL, offset, 0, 0, 0, t0, sfs_readdir(path, buf, filler, offset, fi));
+}
+
+static int trace_symlink(const char *from, const char *to)
+{
+  TRACE_BEGIN(to);
+  return sfs_trace(TRACE_SYMLINK, tpath, from, 0, 0, 0, 0, t0, sfs_symlink(from, to));
+}
+
+static int trace_readlink(const char *path, char *buf, size_t size)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_READLINK, tpath, NULL, 0, size, 0, 0, t0, sfs_readlink(path, buf, size));
+}
+
+static int trace_create(const char *path, mode_t mode, dev_t rdev)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_MKNOD, tpath, NULL, 0, 0, 0, mode, t0, sfs_create(path, mode, rdev));
+}
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_OPEN, tpath, NULL, 0, 0, 0, fi->flags, t0, sfs_open(path, fi));
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_RELEASE, tpath, NULL, 0, 0, 0, 0, t0, sfs_release(path, fi));
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_READ, tpath, NULL, offset, size, 0, 0, t0, sfs_read(path, buf, size, offset, fi));
+}
+
+static int trace_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  // read_buf returns 0 and hands the bytes back in *bufp; the trace records what read would
+  int res = sfs_read_buf(path, bufp, size, offset, fi);
+  sfs_trace(TRACE_READ, tpath, NULL, offset, size, 0, 0, t0, (res == 0) ? (int) fuse_buf_size(*bufp) : res);
+  return res;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_WRITE, tpath, NULL, offset, size, 0, 0, t0, sfs_write(path, buf, size, offset, fi));
+}
+
+static int trace_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  size_t size = fuse_buf_size(buf);
+  return sfs_trace(TRACE_WRITE, tpath, NULL, offset, size, 0, 0, t0, sfs_write_buf(path, buf, offset, fi));
+}
+
+static int trace_truncate(const char *path, off_t size)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_TRUNCATE, tpath, NULL, 0, size, 0, 0, t0, sfs_truncate(path, size));
+}
+
+static int trace_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_TRUNCATE, tpath, NULL, 0, size, 0, 0, t0, sfs_ftruncate(path, size, fi));
+}
+
+static int trace_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_FALLOCATE, tpath, NULL, offset, len, 0, mode, t0, sfs_fallocate(path, mode, offset, len, fi));
+}
+
+static int trace_remove_dir(const char *path)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_RMDIR, tpath, NULL, 0, 0, 0, 0, t0, sfs_remove_dir(path));
+}
+
+static int trace_delete(const char *path)
+{
+  TRACE_BEGIN(path);
+  return sfs_trace(TRACE_UNLINK, tpath, NULL, 0, 0, 0, 0, t0, sfs_delete(path));
+}
+
+static int trace_rename(const char *from, const char *to)
+{
+  TRACE_BEGIN(from);
+  return sfs_trace(TRACE_RENAME, tpath, to, 0, 0, 0, 0, t0, sfs_rename(from, to));
+}
+
+static int trace_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+  TRACE_BEGIN(path);
+  int op = TRACE_IOCTL;
+  int64_t offset = 0, size = 0, offset2 = 0;
+  char src[SFS_PATH_MAX] = "";
+
+  if ((unsigned int) cmd == SFS_IOC_SEEK) {
+    struct sfs_seek *req = data;
+    op     = TRACE_SEEK;
+    offset = req->offset;
+    size   = req->whence;
+  }
+  else if ((unsigned int) cmd == SFS_IOC_DEDUP) {
+    op = TRACE_DEDUP;
+  }
+  else if ((unsigned int) cmd == SFS_IOC_CLONE) {
+    struct sfs_clone *req = data;
+    op      = TRACE_CLONE;
+    offset  = req->dst_offset;
+    offset2 = req->src_offset;
+    size    = req->length;
+    strncpy(src, req->src, sizeof(src) - 1);
+  }
+
+  int result = sfs_ioctl(path, cmd, arg, fi, flags, data);
+  return sfs_trace(op, tpath, (op == TRACE_CLONE) ? src : NULL, offset, size, offset2, (unsigned int) cmd, t0, result);
+}
+
 static struct fuse_operations sfs_oper = {
-    .init    = sfs_mount,
-    .destroy = sfs_unmount,
-    .getattr = sfs_getattr,
-    .mkdir	 = sfs_mkdir,
-    .readdir = sfs_readdir,
-    .symlink = sfs_symlink,
-    .readlink = sfs_readlink,
-    .mknod	 = sfs_create,
-    .read	 = sfs_read,
-    .write	 = sfs_write,
-    .unlink	 = sfs_delete,
-    .rmdir       = sfs_remove_dir,
+    .init      = sfs_mount,
+    .destroy   = sfs_unmount,
+    .getattr   = trace_getattr,
+    .mkdir     = trace_mkdir,
+    .readdir   = trace_readdir,
+    .symlink   = trace_symlink,
+    .readlink  = trace_readlink,
+    .open      = trace_open,
+    .release   = trace_release,
+    .mknod     = trace_create,
+    .read      = trace_read,
+    .read_buf  = trace_read_buf,
+    .write     = trace_write,
+    .write_buf = trace_write_buf,
+    .truncate  = trace_truncate,
+    .ftruncate = trace_ftruncate,
+    .fallocate = trace_fallocate,
+    .unlink    = trace_delete,
+    .rmdir     = trace_remove_dir,
+    .rename    = trace_rename,
+    .ioctl     = trace_ioctl,
 };
 
+/*
+ * Start the trace: the file is opened before fuse_main, which may change directory
+ */
+static int sfs_trace_open(const char *path)
+{
+  trace_fp = fopen(path, "w");
+  if (trace_fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct trace_header header = {
+    .magic   = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .flags   = (conf.compress ? TRACE_F_COMPRESS : 0) | (conf.dedup ? TRACE_F_DEDUP : 0),
+    .start   = now.tv_sec * 1000000000ULL + now.tv_nsec
+  };
+  fwrite(&header, sizeof(header), 1, trace_fp);
+  trace_start = sfs_now();
+
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    if (fuse_opt_parse(&args, &conf, sfs_opts, NULL) == -1) return 1;
+
+    if (conf.loglevel != NULL && (log_level = log_parse_level(conf.loglevel)) < 0) {
+      fprintf(stderr, "loglevel must be error, warn, info or debug\n");
+      return 1;
+    }
+    // FUSE changes to / when it goes into the background
+    static char logfile[PATH_MAX];
+    if (conf.logfile != NULL && conf.logfile[0] != '/' && getcwd(logfile, sizeof(logfile)) != NULL) {
+      snprintf(logfile + strlen(logfile), sizeof(logfile) - strlen(logfile), "/%s", conf.logfile);
+      conf.logfile = logfile;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sfs_mutex, &attr);
+    pthread_key_create(&stats_key, stats_release);
+    event_op_names(sfs_op_names, OP_COUNT);
+
+    struct sigaction dump = { .sa_handler = events_signal, .sa_flags = SA_RESTART };
+    sigaction(SIGUSR1, &dump, NULL);
+
+    if (conf.trace != NULL && sfs_trace_open(conf.trace) < 0) return 1;
+
     umask(0); 
-    return fuse_main(argc, argv, &sfs_oper, NULL);
+    return fuse_main(args.argc, args.argv, &sfs_oper, NULL);
 }
 
@@ -1,7 +1,7 @@
 #define FUSE_USE_VERSION 26
 
 #ifdef linux
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 #endif
 
 #include <fuse.h>
@@ -17,12 +17,23 @@
 #include <sys/statfs.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "sfs_ioctl.h"
+#include "FilesystemDriver/trace.h"
+#include "FilesystemDriver/events.h"
+#include "FilesystemDriver/probes.h"
+#include "FilesystemDriver/log.h"
+#include <signal.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
 
 #define BLOCK_SIZE 512
+#define MAX_DIRENT 8
+#define DIRECT_BLOCKS 8
 struct superblock {
     uint32_t s_inodes_count; /* total number of inodes (used and free) */
     uint32_t s_blocks_count; /* total number of blocks (used and free) */ 
@@ -31,9 +42,20 @@ struct superblock {
     uint32_t s_first_data_block; /* which block is the first data block */
     uint32_t s_first_ino; /* index to first inode thats non-reserved */
     uint32_t s_magic;   /* Magic Signature is 0x554e4958 */
+    uint32_t s_log_block_size; /* block size is BLOCK_SIZE << s_log_block_size */
+    uint32_t s_flags;   /* SB_ITABLE_UNINIT etc., see FilesystemDriver/simpleFS.h */
+    uint32_t s_itable_init; /* inode table blocks written so far, if SB_ITABLE_UNINIT */
+    uint32_t s_tail_block; /* tail block that last had room for small files, 0 for none */
+    uint32_t s_refcount_block; /* first block of the block reference count table, 0 for none */
+    uint32_t s_csum_block; /* first block of the checksum table, if SB_METADATA_CSUM */
+    uint32_t s_bitmap_csum[2]; /* checksums of the block and the inode bitmap */
+    uint32_t s_checksum; /* checksum of the superblock up to here */
     /* remaining bytes are unused*/
 };
 
+#define SB_METADATA_CSUM 0x2
+#define SB_DATA_CSUM     0x4
+
 struct inode {
     uint16_t i_mode;          /* File type (S_ISREG or S_ISDIR) and Permissions */
     uint16_t i_uid;           /* File owner */
@@ -44,14 +66,18 @@ struct inode {
     uint32_t i_ctime;         /* Creation time */
     uint32_t i_mtime;         /* Last modified time */
     uint32_t i_dtime;         /* When was this inode deleted */
-    uint32_t i_blocks;        /* How many blocks are allocated to this file */
+    uint16_t i_blocks;        /* How many blocks are allocated to this file */
+    uint16_t i_flags;         /* INODE_EOFBLOCKS etc., see FilesystemDriver/simpleFS.h */
 
-    uint32_t i_block[8];
+    uint32_t i_block[DIRECT_BLOCKS];
     /* pointers to the blocks of data. (which datablock from first)
      * All point to direct blocks
      * */
 };
 
+#define INODE_SNAPSHOT 0x10
+#define SNAPSHOT_DIR   ".snapshots"
+
 /*
  * A directory should have 2 default entries when starting
  * first: a '.' dir pointing to itself
@@ -60,12 +86,36 @@ struct inode {
  */
 struct directory_entry {
     uint32_t        d_inode;        /* inode number */ 
-    uint16_t        d_file_type;    /* 1 for regular file, 2 for directory */
+    uint16_t        d_file_type;    /* 1 for regular file, 2 for directory, 7 for symbolic link */
     uint8_t         d_name_len;     /* length of file name */
     char            d_name[57]   ;    /* file name 0-57 bytes*/
 };
 
 
+/*
+ * A run of file bytes that are contiguous in the disk image
+ */
+struct extent {
+    uint64_t        e_pos;          /* byte offset in the image, 0 for a hole */
+    uint32_t        e_len;          /* number of bytes */
+    uint32_t        e_flags;        /* EXTENT_COMPRESSED: read the bytes with read_file_data */
+};
+
+#define EXTENT_COMPRESSED 0x1
+
+/*
+ * Running totals kept by the library since the image was opened
+ */
+struct fs_counters {
+    uint64_t bytes_read;      /* image bytes read */
+    uint64_t bytes_written;   /* image bytes written */
+    uint64_t seeks;           /* accesses away from where the last one ended */
+    uint64_t csum_hits;       /* checksums not checked again */
+    uint64_t csum_misses;     /* checksums checked */
+    uint64_t dedup_hits;      /* blocks found in the dedup index and shared */
+    uint64_t dedup_misses;    /* blocks that weren't */
+};
+
 /* 
  * Prototypes
  */
@@ -74,10 +124,28 @@ extern void open_filesystem(char *real_path, unsigned int n);
 extern int make_directory(char *path, unsigned int n);
 extern unsigned int read_directory(char *path, unsigned int n, char *data);
 extern int rm_directory(char *path, unsigned int n);
+extern int rm_tree(char *path, unsigned int n);
+extern int make_snapshot(char *name, unsigned int n);
+extern int delete_snapshot(char *name, unsigned int n);
 extern int create_file(char *path, unsigned int n, unsigned int size, char *data);
 extern int rm_file (char *path, unsigned int n);
 extern unsigned int read_file(char *path, unsigned int n, char *data);
 extern int make_link(char *path, unsigned int n, char *target);
+extern int list_directory(char *path, unsigned int n, struct directory_entry *entries);
+extern int make_symlink(char *path, unsigned int n, char *target);
+extern int read_symlink(char *path, unsigned int n, char *buf, size_t size);
+extern int rename_path(char *from, unsigned int n, char *to, unsigned int m);
+extern int read_file_map(char *path, unsigned int n, size_t size, off_t offset, struct extent *ext, int max);
+extern off_t seek_file(char *path, unsigned int n, off_t offset, int whence);
+extern int write_file_map(char *path, unsigned int n, size_t size, off_t offset, struct extent *ext, int max);
+extern int read_file_data(char *path, unsigned int n, char *data, size_t size, off_t offset);
+extern int write_file_compressed(char *path, unsigned int n, char *data, size_t size, off_t offset);
+extern int truncate_file(char *path, unsigned int n, off_t size);
+extern int allocate_file(char *path, unsigned int n, int mode, off_t offset, off_t len);
+extern int dedup_file(char *path, unsigned int n, off_t offset, size_t size);
+extern int clone_file(char *from, unsigned int n, char *to, unsigned int m, off_t src_off, off_t dst_off, size_t len);
+extern int verify_file_data(char *path, unsigned int n, off_t offset, size_t size);
+extern int update_file_csums(char *path, unsigned int n, off_t offset, size_t size);
 
 /*-------------------------------------------------------------------------*/
 int          my_create(char *path, unsigned int n, int size, char *data, int type);
@@ -90,11 +158,17 @@ void init_direntry(struct directory_entry *dirent, uint32_t current_inode, uint3
 char *create_path(char *path, unsigned int n);
 int   validate_path(char *npath, int type);
 int   check_permissions(uint16_t mode, uint16_t mask);
+uint32_t dirent_cookie(struct directory_entry *dirent);
 
 void update_superblock(int add, int num_data_blocks);
 void update_bitmaps();
 
+void         image_access(uint64_t pos, uint64_t len);
+void         image_flush();
+
 void         read_inode(struct inode *node, uint32_t index);
+void         read_inodes(struct inode *nodes, uint32_t *index, int n);
+uint64_t     prefetch_inodes(uint32_t *index, int n);
 void         read_direntry(struct directory_entry *entries, uint32_t index, int n);
 unsigned int read_data(char *data, uint32_t index, int n);
 
@@ -106,10 +180,12 @@ int  get_inode();
 int  get_datablock(int index);
 
 int errno; 
-FILE *fp;
-struct superblock sb;
-unsigned char block_bm[BLOCK_SIZE];
-unsigned char inode_bm[BLOCK_SIZE];
+extern FILE *fp;
+extern struct superblock sb;
+extern unsigned char block_bm[BLOCK_SIZE];
+extern unsigned char inode_bm[BLOCK_SIZE];
+extern unsigned char block_rc[BLOCK_SIZE * 8];
+extern struct fs_counters counters;
 extern unsigned int INO_SIZE;
 extern unsigned int DIR_ENTRY_SIZE;
 
@@ -1,5 +1,10 @@
-#include "simpleFS.h"
-#include "helper.h"
+#include "FilesystemDriver/simpleFS.h"
+#include "FilesystemDriver/helper.h"
+#include "FilesystemDriver/lz.h"
+#include "FilesystemDriver/crc32c.h"
+#include "FilesystemDriver/events.h"
+#include "FilesystemDriver/probes.h"
+#include "FilesystemDriver/log.h"
 
 /* ------------------------------------------------------ */
 /*                 LOW LEVEL FUNCTIONS                    */
@@ -12,7 +17,9 @@ void init_inode(struct inode *node, int type, int size, int index)
 {
   time_t t = time(NULL);
 
-  node->i_mode        = type == 2 ? S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO : S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+  if      (type == 2) node->i_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+  else if (type == 7) node->i_mode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
+  else                node->i_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
   node->i_uid         = getuid();
   node->i_gid         = getgid();
   node->i_links_count = 1;
@@ -21,19 +28,362 @@ void init_inode(struct inode *node, int type, int size, int index)
   node->i_ctime       = t;
   node->i_mtime       = t;
   node->i_dtime       = 0;
-  node->i_blocks      = (size == 0) ? 1 : size / BLOCK_SIZE + ((size % BLOCK_SIZE != 0));
+  node->i_blocks      = 0;
+  node->i_flags       = 0;
+
+  // files start out as one hole; their blocks are allocated as data is written to them
+  int i;
+  for (i = 0; i < DIRECT_BLOCKS; i++) node->i_block[i] = BLOCK_HOLE;
+  if (type != 2) return;
 
   // if all data blocks are occupied then don't initialize inode
-  if (sb.s_free_blocks_count < node->i_blocks) {
-    printf("Disk is full - blocks = %d\n", sb.s_free_blocks_count);
+  if (sb.s_free_blocks_count < 1) {
+    log_msg(LVL_WARN, "Disk is full - blocks = %d", sb.s_free_blocks_count);
     inode_bm[index / 8] &= ~(1 << (index % 8));
     node = NULL;
     exit(1);
   }
 
+  node->i_blocks   = 1;
+  node->i_block[0] = get_datablock(index);
+}
+
+/**
+ * Number of block pointers of a file or directory that are in use, holes included.
+ * Images made before holes existed gave empty files a block, which still counts
+ */
+int file_slots(struct inode *node)
+{
+  int slots = (node->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (node->i_flags & (INODE_INLINE | INODE_TAIL)) return 0;
+  if (node->i_flags & INODE_EOFBLOCKS) return DIRECT_BLOCKS;
+  if (slots == 0 && node->i_blocks > 0) slots = 1;
+  if (node->i_flags & INODE_COMPRESSED) slots = (slots + CLUSTER_BLOCKS - 1) / CLUSTER_BLOCKS * CLUSTER_BLOCKS;
+  if (slots > DIRECT_BLOCKS) slots = DIRECT_BLOCKS;
+
+  return slots;
+}
+
+/**
+ * Set or clear INODE_EOFBLOCKS depending on whether node has blocks past its end of file.
+ * The pointers past file_slots must already be holes or real blocks
+ */
+void update_eof_flag(struct inode *node)
+{
+  int i;
+
+  node->i_flags &= ~INODE_EOFBLOCKS;
+  for (i = (node->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE; i < DIRECT_BLOCKS; i++) {
+    if (node->i_block[i] != BLOCK_HOLE && node->i_block[i] != BLOCK_COMPRESSED) node->i_flags |= INODE_EOFBLOCKS;
+  }
+}
+
+/**
+ * Bytes a small file can grow to where it is: in its inode, in its tail slot, or 0 for neither
+ */
+uint32_t small_capacity(struct inode *node)
+{
+  if (node->i_flags & INODE_INLINE) return INLINE_MAX;
+  if (node->i_flags & INODE_TAIL)   return node->i_block[2];
+
+  return 0;
+}
+
+/**
+ * Byte offset in the image of the first byte of a tail packed file
+ */
+uint64_t tail_addr(struct inode *node)
+{
+  return START_DATA_ADDR + (uint64_t) BLOCK_SIZE * node->i_block[0] + node->i_block[1];
+}
+
+/**
+ * Reserve a slot of len bytes in a tail block, trying the one the superblock remembers before
+ * starting a new one. Returns 1 if a new block was taken, 0 if not, -1 if there is no room
+ */
+int tail_alloc(uint32_t len, uint32_t *block, uint32_t *off)
+{
+  unsigned char map[TAIL_UNITS / 8];
+  int units = (len + TAIL_UNIT - 1) / TAIL_UNIT, u = 1, run = 0, taken = 0, i;
+  uint32_t b = sb.s_tail_block;
+
+  if (b != 0 && (block_bm[b / 8] & (1 << (b % 8)))) {
+    image_seek(START_DATA_ADDR + BLOCK_SIZE * b);
+    image_read(map, 1, sizeof(map));
+    for (; (map[0] & 1) && u < TAIL_UNITS && run < units; u++) {
+      if (map[u / 8] & (1 << (u % 8))) run = 0;
+      else                             run++;
+    }
+  }
+
+  if (run < units) {
+    int fresh = alloc_datablock();
+    if (fresh == -1) return -1;
+
+    b      = fresh;
+    u      = 1 + units;
+    taken  = 1;
+    memset(map, 0, sizeof(map));
+    map[0] = 1;
+    sb.s_tail_block = b;
+  }
+
+  // u is one past the run
+  for (i = u - units; i < u; i++) map[i / 8] |= 1 << (i % 8);
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * b);
+  image_write(map, 1, sizeof(map));
+  csum_refresh(b);
+
+  *block = b;
+  *off   = (u - units) * TAIL_UNIT;
+
+  return taken;
+}
+
+/**
+ * Give back a tail slot. Returns 1 if that emptied the tail block and freed it, 0 if not
+ */
+int tail_free(uint32_t block, uint32_t off, uint32_t len)
+{
+  unsigned char map[TAIL_UNITS / 8];
+  int i, used = 0;
+
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * block);
+  image_read(map, 1, sizeof(map));
+
+  for (i = off / TAIL_UNIT; i < (off + len) / TAIL_UNIT; i++) map[i / 8] &= ~(1 << (i % 8));
+  for (i = 1; i < TAIL_UNITS; i++) used += (map[i / 8] >> (i % 8)) & 1;
+
+  if (used == 0) {
+    block_bm[block / 8] &= ~(1 << (block % 8));
+    if (sb.s_tail_block == block) sb.s_tail_block = 0;
+    return 1;
+  }
+
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * block);
+  image_write(map, 1, sizeof(map));
+  csum_refresh(block);
+  if (sb.s_tail_block == 0) sb.s_tail_block = block;
+
+  return 0;
+}
+
+/**
+ * Move a small file (inline, tail packed, or one without blocks, which reads as zeros)
+ * into a tail slot that holds size bytes. The slot is zero past the file's bytes.
+ * Returns -ENOSPC if no tail block has room and there is no free block
+ */
+int pack_tail(struct inode *node, uint32_t size)
+{
+  char data[TAIL_MAX] = "";
+  uint32_t block, off;
+
+  if (node->i_flags & INODE_INLINE) memcpy(data, node->i_block, node->i_size);
+  if (node->i_flags & INODE_TAIL) {
+    image_seek(tail_addr(node));
+    image_read(data, 1, node->i_size);
+  }
+
+  int taken = tail_alloc(size, &block, &off);
+  if (taken < 0) return -ENOSPC;
+
+  int freed = 0;
+  if (node->i_flags & INODE_TAIL) freed = tail_free(node->i_block[0], node->i_block[1], node->i_block[2]);
+
+  memset(node->i_block, 0, sizeof(node->i_block));
+  node->i_flags    = (node->i_flags & ~INODE_INLINE) | INODE_TAIL;
+  node->i_block[0] = block;
+  node->i_block[1] = off;
+  node->i_block[2] = (size + TAIL_UNIT - 1) / TAIL_UNIT * TAIL_UNIT;
+
+  image_seek(tail_addr(node));
+  image_write(data, 1, node->i_block[2]);
+  csum_refresh(block);
+
+  sb.s_free_blocks_count += freed - taken;
+  write_superblock();
+  update_bitmaps();
+
+  return 0;
+}
+
+/**
+ * Move the bytes of an inline or tail packed file into a data block of its own, so the
+ * file can grow past TAIL_MAX or get blocks allocated. Returns -ENOSPC if there is no free block
+ */
+int unpack_small(struct inode *node)
+{
+  char data[BLOCK_SIZE] = "";
+  int freed = 0;
+
+  if ((node->i_flags & (INODE_INLINE | INODE_TAIL)) == 0) return 0;
+  if (node->i_size > 0 && sb.s_free_blocks_count < 1) return -ENOSPC;
+
+  if (node->i_flags & INODE_INLINE) memcpy(data, node->i_block, node->i_size);
+  if (node->i_flags & INODE_TAIL) {
+    image_seek(tail_addr(node));
+    image_read(data, 1, node->i_size);
+    freed = tail_free(node->i_block[0], node->i_block[1], node->i_block[2]);
+  }
+
+  memset(node->i_block, 0, sizeof(node->i_block));
+  node->i_flags &= ~(INODE_INLINE | INODE_TAIL);
+
+  if (node->i_size > 0) {
+    node->i_block[0] = alloc_datablock();
+    node->i_blocks   = 1;
+    write_data(data, node->i_block[0], node->i_size);
+    freed -= 1;
+  }
+
+  sb.s_free_blocks_count += freed;
+  write_superblock();
+  update_bitmaps();
+
+  return 0;
+}
+
+/**
+ * Whether cluster c of a file with INODE_COMPRESSED is stored compressed
+ */
+int cluster_compressed(struct inode *node, int c)
+{
+  return node->i_block[c * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1] == BLOCK_COMPRESSED;
+}
+
+/**
+ * Read cluster c of a file into buf (CLUSTER_SIZE bytes, zeros where nothing is stored).
+ * Returns how many bytes the cluster holds, or -EIO if its compressed data is corrupt
+ */
+int read_cluster(struct inode *node, int c, char *buf)
+{
+  uint32_t *slot = node->i_block + c * CLUSTER_BLOCKS;
+  char packed[CLUSTER_SIZE];
+  int i;
+
+  memset(buf, 0, CLUSTER_SIZE);
+  if ((node->i_flags & INODE_COMPRESSED) == 0 || cluster_compressed(node, c) == 0) {
+    for (i = 0; i < CLUSTER_BLOCKS; i++) {
+      if (slot[i] != BLOCK_HOLE) read_data(buf + i * BLOCK_SIZE, slot[i], BLOCK_SIZE);
+    }
+    return CLUSTER_SIZE;
+  }
+
+  for (i = 0; i < CLUSTER_BLOCKS && slot[i] != BLOCK_COMPRESSED; i++) read_data(packed + i * BLOCK_SIZE, slot[i], BLOCK_SIZE);
+  if (i == 0 || i == CLUSTER_BLOCKS) {
+    log_msg(LVL_ERROR, "Compressed cluster %d is corrupt", c);
+    return -EIO;
+  }
+
+  uint16_t head[2];
+  memcpy(head, packed, sizeof(head));
+  if (head[0] > i * BLOCK_SIZE - sizeof(head) || lz_decompress(packed + sizeof(head), head[0], buf, CLUSTER_SIZE) != head[1]) {
+    log_msg(LVL_ERROR, "Compressed cluster %d is corrupt", c);
+    return -EIO;
+  }
+
+  return head[1];
+}
+
+/**
+ * Store the first len bytes of buf as cluster c of a file, in place of what the cluster held.
+ * With compress, the cluster is compressed if that takes fewer blocks than storing it as is;
+ * otherwise every block that isn't all zeros gets a block and the rest are holes. The new
+ * blocks are taken as one run. The superblock count and i_blocks are updated, the bitmaps
+ * and superblock aren't written. Returns -ENOSPC (with nothing changed) if the blocks don't fit
+ */
+int write_cluster(struct inode *node, int c, char *buf, int len, int compress)
+{
+  uint32_t *slot = node->i_block + c * CLUSTER_BLOCKS;
+  uint32_t run[CLUSTER_BLOCKS];
+  char packed[CLUSTER_SIZE];
+  int i, j, old = 0, owned = 0, freed = 0, raw = 0, clen = -1;
+
+  // blocks shared with other files stay in use after this file lets go of them
+  for (i = 0; i < CLUSTER_BLOCKS; i++) {
+    if (slot[i] == BLOCK_HOLE || slot[i] == BLOCK_COMPRESSED) continue;
+    owned++;
+    if (block_shared(slot[i]) == 0) old++;
+  }
+  for (i = 0; i * BLOCK_SIZE < len; i++) {
+    int part = (len - i * BLOCK_SIZE < BLOCK_SIZE) ? len - i * BLOCK_SIZE : BLOCK_SIZE;
+    if (is_zero(buf + i * BLOCK_SIZE, part) == 0) raw++;
+  }
+
+  uint16_t head[2] = { 0, len };
+  if (compress && raw > 1) clen = lz_compress(buf, len, packed + sizeof(head), (raw - 1) * BLOCK_SIZE - sizeof(head));
+  int blocks = (clen >= 0) ? (clen + sizeof(head) + BLOCK_SIZE - 1) / BLOCK_SIZE : raw;
+  if (blocks > sb.s_free_blocks_count + old) return -ENOSPC;
+
+  for (i = 0; i < CLUSTER_BLOCKS; i++) {
+    if (slot[i] != BLOCK_HOLE && slot[i] != BLOCK_COMPRESSED) freed += free_block(slot[i]);
+    slot[i] = BLOCK_HOLE;
+  }
+  alloc_run(run, blocks);
+  sb.s_free_blocks_count += freed - blocks;
+  node->i_blocks         += blocks - owned;
+
+  if (clen >= 0) {
+    head[0] = clen;
+    memcpy(packed, head, sizeof(head));
+    for (i = 0; i < blocks; i++) {
+      int part = (clen + sizeof(head) - i * BLOCK_SIZE < BLOCK_SIZE) ? clen + sizeof(head) - i * BLOCK_SIZE : BLOCK_SIZE;
+      write_data(packed + i * BLOCK_SIZE, run[i], part);
+      slot[i] = run[i];
+    }
+    for (; i < CLUSTER_BLOCKS; i++) slot[i] = BLOCK_COMPRESSED;
+    node->i_flags |= INODE_COMPRESSED;
+    return 0;
+  }
+
+  for (i = 0, j = 0; i * BLOCK_SIZE < len; i++) {
+    int part = (len - i * BLOCK_SIZE < BLOCK_SIZE) ? len - i * BLOCK_SIZE : BLOCK_SIZE;
+    if (is_zero(buf + i * BLOCK_SIZE, part)) continue;
+
+    write_data(buf + i * BLOCK_SIZE, run[j], part);
+    slot[i] = run[j++];
+  }
+
+  return 0;
+}
+
+/**
+ * Store cluster c of a file uncompressed again, so its blocks can be written in place
+ */
+int expand_cluster(struct inode *node, int c)
+{
+  char buf[CLUSTER_SIZE];
+
+  if ((node->i_flags & INODE_COMPRESSED) == 0 || cluster_compressed(node, c) == 0) return 0;
+
+  int len = read_cluster(node, c, buf);
+  if (len < 0) return len;
+
+  return write_cluster(node, c, buf, len, 0);
+}
+
+/**
+ * Set or clear INODE_COMPRESSED depending on whether any cluster of node is still compressed
+ */
+void update_compressed_flag(struct inode *node)
+{
+  int c, packed = 0;
+
+  if ((node->i_flags & INODE_COMPRESSED) == 0) return;
+  for (c = 0; c < DIRECT_BLOCKS / CLUSTER_BLOCKS; c++) packed |= cluster_compressed(node, c);
+  if (packed == 0) node->i_flags &= ~INODE_COMPRESSED;
+}
+
+/**
+ * Check if the n bytes at data are all zero
+ */
+int is_zero(const char *data, int n)
+{
   int i;
-  if (node->i_size != 0) for (i = 0; i < node->i_blocks; i++)  node->i_block[i] = get_datablock(index);
-  else node->i_block[0] = get_datablock(index);
+  for (i = 0; i < n; i++) if (data[i] != 0) return 0;
+
+  return 1;
 }
 
 /**
@@ -56,6 +406,37 @@ void init_direntry(struct directory_entry *dirent, uint32_t current_inode, uint3
   strcpy(dirent[1].d_name, "..");
 }
 
+/**
+ * Check if a directory entry type matches the type asked for. Symbolic links (7) count as files (1)
+ */
+int dirent_is_type(uint16_t file_type, int type)
+{
+  if (file_type == type) return 1;
+  if (type == 1 && file_type == 7) return 1;
+
+  return 0;
+}
+
+/**
+ * Readdir offset of a directory entry. "." and ".." come first and every other entry is keyed
+ * by a hash of its name, so an offset handed out earlier still points to the same place after
+ * entries are added to or removed from the directory
+ */
+uint32_t dirent_cookie(struct directory_entry *dirent)
+{
+  if (strcmp(dirent->d_name, ".")  == 0) return 1;
+  if (strcmp(dirent->d_name, "..") == 0) return 2;
+
+  uint32_t hash = 2166136261u;
+  unsigned char *c = (unsigned char *) dirent->d_name;
+  while (*c != '\0') {
+    hash ^= *c++;
+    hash *= 16777619u;
+  }
+
+  return 3 + hash % (INT32_MAX - 3);
+}
+
 /**
  * Check read/write/execute permission for users/groups/others
  */
@@ -66,6 +447,39 @@ int check_permissions(uint16_t mode, uint16_t mask)
   return 0;
 }
 
+/**
+ * Check if the current user may read and write node, going by its owner, group or other bits
+ */
+int check_rw_access(struct inode *node)
+{
+  if (node->i_uid == getuid()) return check_permissions(node->i_mode, S_IRUSR | S_IWUSR);
+  if (node->i_gid == getgid()) return check_permissions(node->i_mode, S_IRGRP | S_IWGRP);
+
+  return check_permissions(node->i_mode, S_IROTH | S_IWOTH);
+}
+
+/**
+ * Check if the current user may read node, going by its owner, group or other bits
+ */
+int check_r_access(struct inode *node)
+{
+  if (node->i_uid == getuid()) return check_permissions(node->i_mode, S_IRUSR);
+  if (node->i_gid == getgid()) return check_permissions(node->i_mode, S_IRGRP);
+
+  return check_permissions(node->i_mode, S_IROTH);
+}
+
+/**
+ * Check if the current user may write node, going by its owner, group or other bits
+ */
+int check_w_access(struct inode *node)
+{
+  if (node->i_uid == getuid()) return check_permissions(node->i_mode, S_IWUSR);
+  if (node->i_gid == getgid()) return check_permissions(node->i_mode, S_IWGRP);
+
+  return check_permissions(node->i_mode, S_IWOTH);
+}
+
 /**
  * Create a path string as a null terminated string
  */
@@ -76,7 +490,7 @@ char *create_path(char *path, unsigned int n)
   else                        npath = malloc(n + 1);
 
   if (npath == NULL) {
-    printf("Malloc failed\n");
+    log_msg(LVL_ERROR, "Malloc failed");
     return NULL;
   }
 
@@ -95,8 +509,9 @@ char *create_path(char *path, unsigned int n)
 /**
  *  Validate the given path and return the inode index of the target file/dir if the path is valid
  */
-int validate_path(char *npath, int target_type)
+static int lookup_path(char *npath, int target_type)
 {
+  csum_failed(); // mismatches found before this lookup were reported already
   char *current_child   = strtok(npath, "/");
   uint32_t parent_inode = START_INODE;
   
@@ -120,29 +535,42 @@ int validate_path(char *npath, int target_type)
     
     if (current_child == NULL) {//&& entries[i].d_file_type != target_type) {
       if (i == n) return -ENOENT;
-      if (target_type != 3 && entries[i].d_file_type != target_type) {
-	printf("Invalid path\n");
+      if (target_type != 3 && dirent_is_type(entries[i].d_file_type, target_type) == 0) {
+	log_msg(LVL_DEBUG, "Invalid path");
 	return -ENOENT;
       }
     }
   
   
     // return error if invlid path
-    if (current_child != NULL && (i == n || entries[i].d_file_type == 1)) {
-      printf("Invalid path\n");
+    if (current_child != NULL && (i == n || entries[i].d_file_type != 2)) {
+      log_msg(LVL_DEBUG, "Invalid path");
       return -ENOTDIR;
     }
 
-    // read new parent inode and its directories
+    // read new parent inode and, unless it is the target, its directories
     read_inode(&current_inode, parent_inode);
+    if (current_child == NULL) break;
     
     n = current_inode.i_size / sizeof(struct directory_entry);
     read_direntry(entries, current_inode.i_block[0], MAX_DIRENT);
   }
 
+  // an inode or directory block on the way didn't match its checksum
+  if (csum_failed()) return -EIO;
+
   return parent_inode;
 }
 
+int validate_path(char *npath, int target_type)
+{
+  PROBE2(validate_path_entry, npath, target_type);
+  int index = lookup_path(npath, target_type);
+  PROBE1(validate_path_return, index);
+
+  return index;
+}
+
 /**
  * Update and write superblock to the disk
  */
@@ -159,8 +587,232 @@ void update_superblock(int add, int num_data_blocks)
     sb.s_free_blocks_count -= num_data_blocks;
   }
   // write
-  fseek(fp, 0, SEEK_SET);
-  fwrite(&sb, sizeof(struct superblock), 1, fp);
+  write_superblock();
+}
+
+/**
+ * Write the in-memory superblock to the disk
+ */
+void write_superblock()
+{
+  if (sb.s_flags & SB_METADATA_CSUM) sb.s_checksum = crc32c(0, &sb, offsetof(struct superblock, s_checksum));
+
+  image_seek(0);
+  image_write(&sb, sizeof(struct superblock), 1);
+}
+
+/*
+ * Checksums (SB_METADATA_CSUM, SB_DATA_CSUM). An inode or data block whose checksum was
+ * written or checked since the image was opened has its bit set in csum_seen and isn't
+ * checked again. A mismatch is remembered until csum_failed is asked about it.
+ */
+static unsigned char csum_seen_inode[BLOCK_SIZE];
+static unsigned char csum_seen_block[BLOCK_SIZE];
+static int csum_bad = 0;
+
+/**
+ * Forget which checksums were checked, as when another image is opened
+ */
+void csum_reset()
+{
+  memset(csum_seen_inode, 0, BLOCK_SIZE);
+  memset(csum_seen_block, 0, BLOCK_SIZE);
+  csum_bad = 0;
+}
+
+/**
+ * Whether a checksum mismatch was found since the last call
+ */
+int csum_failed()
+{
+  int bad  = csum_bad;
+  csum_bad = 0;
+
+  return bad;
+}
+
+/**
+ * Write entry slot of the checksum table (inodes first, then data blocks)
+ */
+static void csum_store(uint32_t slot, uint32_t crc)
+{
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * sb.s_csum_block + sizeof(crc) * slot);
+  image_write(&crc, sizeof(crc), 1);
+}
+
+/**
+ * Read entry slot of the checksum table
+ */
+static uint32_t csum_load(uint32_t slot)
+{
+  uint32_t crc = 0;
+
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * sb.s_csum_block + sizeof(crc) * slot);
+  image_read(&crc, sizeof(crc), 1);
+
+  return crc;
+}
+
+/**
+ * Store the checksum of an inode as it is written
+ */
+void csum_inode(struct inode *node, uint32_t index)
+{
+  if ((sb.s_flags & SB_METADATA_CSUM) == 0) return;
+
+  csum_store(index, crc32c(0, node, sizeof(struct inode)));
+  csum_seen_inode[index / 8] |= 1 << (index % 8);
+}
+
+/**
+ * Check an inode read from the disk against its checksum, the first time only.
+ * Free inodes may never have been written and aren't checked. Returns 0 or -EIO
+ */
+int verify_inode(struct inode *node, uint32_t index)
+{
+  if ((sb.s_flags & SB_METADATA_CSUM) == 0 || index < START_INODE || (inode_bm[index / 8] & (1 << (index % 8))) == 0) return 0;
+  if (csum_seen_inode[index / 8] & (1 << (index % 8))) {
+    counters.csum_hits++;
+    return 0;
+  }
+  counters.csum_misses++;
+  event(EV_INODE_CSUM_MISS, index, 0, 0);
+
+  if (crc32c(0, node, sizeof(struct inode)) != csum_load(index)) {
+    log_msg(LVL_ERROR, "Inode %u does not match its checksum", index);
+    csum_bad = 1;
+    return -EIO;
+  }
+
+  csum_seen_inode[index / 8] |= 1 << (index % 8);
+  return 0;
+}
+
+/**
+ * Store the checksum of a whole block as it is written
+ */
+void csum_block(const char *data, uint32_t block)
+{
+  if ((sb.s_flags & SB_METADATA_CSUM) == 0) return;
+
+  csum_store(sb.s_inodes_count + block, crc32c(0, data, BLOCK_SIZE));
+  csum_seen_block[block / 8] |= 1 << (block % 8);
+}
+
+/**
+ * Checksum a file data block again after part of it was written in place
+ */
+void csum_refresh(uint32_t block)
+{
+  char data[BLOCK_SIZE];
+
+  if ((sb.s_flags & SB_DATA_CSUM) == 0) return;
+
+  read_data(data, block, BLOCK_SIZE);
+  csum_block(data, block);
+}
+
+/**
+ * Check a whole block read from the disk against its checksum, the first time only.
+ * Returns 0 or -EIO
+ */
+int verify_block(const char *data, uint32_t block)
+{
+  if ((sb.s_flags & SB_METADATA_CSUM) == 0) return 0;
+  if (csum_seen_block[block / 8] & (1 << (block % 8))) {
+    counters.csum_hits++;
+    return 0;
+  }
+  counters.csum_misses++;
+  event(EV_BLOCK_CSUM_MISS, block, 0, 0);
+
+  if (crc32c(0, data, BLOCK_SIZE) != csum_load(sb.s_inodes_count + block)) {
+    log_msg(LVL_ERROR, "Block %u does not match its checksum", block);
+    csum_bad = 1;
+    return -EIO;
+  }
+
+  csum_seen_block[block / 8] |= 1 << (block % 8);
+  return 0;
+}
+
+/**
+ * Check a file data block against its checksum (with SB_DATA_CSUM), reading it only if it
+ * wasn't checked before. Returns 0 or -EIO
+ */
+int check_block(uint32_t block)
+{
+  char data[BLOCK_SIZE];
+
+  if ((sb.s_flags & SB_DATA_CSUM) == 0) return 0;
+  if (csum_seen_block[block / 8] & (1 << (block % 8))) {
+    counters.csum_hits++;
+    return 0;
+  }
+
+  read_data(data, block, BLOCK_SIZE);
+  return verify_block(data, block);
+}
+
+static uint64_t image_at;    /* where fp is */
+static uint64_t image_end;   /* where the last access to the image ended */
+static uint64_t image_dirty; /* bytes written through fp since it was last flushed */
+
+/**
+ * Count an access to len bytes at pos as a seek unless it starts where the last one ended
+ */
+void image_access(uint64_t pos, uint64_t len)
+{
+  if (pos != image_end) counters.seeks++;
+  image_end = pos + len;
+}
+
+/**
+ * fseek, fread and fwrite of the image, counted in counters
+ */
+void image_seek(uint64_t pos)
+{
+  fseek(fp, pos, SEEK_SET);
+  image_at = pos;
+}
+
+size_t image_read(void *data, size_t size, size_t n)
+{
+  size_t done = fread(data, size, n, fp);
+  image_access(image_at, done * size);
+  image_at += done * size;
+  counters.bytes_read += done * size;
+  return done;
+}
+
+size_t image_write(const void *data, size_t size, size_t n)
+{
+  size_t done = fwrite(data, size, n, fp);
+  image_access(image_at, done * size);
+  image_at += done * size;
+  counters.bytes_written += done * size;
+  image_dirty            += done * size;
+  return done;
+}
+
+/**
+ * fflush the image, noting how long it took if it had anything to write out
+ */
+void image_flush()
+{
+  if (image_dirty == 0) {
+    fflush(fp);
+    return;
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  fflush(fp);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+  event(EV_FLUSH, image_dirty, (ns < UINT32_MAX) ? ns : UINT32_MAX - 1, 0);
+  image_dirty = 0;
 }
 
 /**
@@ -168,8 +820,103 @@ void update_superblock(int add, int num_data_blocks)
  */
 void read_inode(struct inode *node, uint32_t index)
 {
-  fseek(fp, START_INODE_ADDR + sizeof(struct inode) * index, SEEK_SET);
-  fread(node, sizeof(struct inode), 1, fp);
+  PROBE1(read_inode_entry, index);
+  if ((sb.s_flags & SB_ITABLE_UNINIT) && index / INODES_PER_BLOCK >= sb.s_itable_init) {
+    memset(node, 0, sizeof(struct inode));
+  }
+  else {
+    image_seek(START_INODE_ADDR + sizeof(struct inode) * index);
+    image_read(node, sizeof(struct inode), 1);
+    verify_inode(node, index);
+  }
+  PROBE1(read_inode_return, index);
+}
+
+/**
+ * Read n inodes from the disk. The inode table is walked in block order so that
+ * inodes sharing a block cost one read
+ */
+void read_inodes(struct inode *nodes, uint32_t *index, int n)
+{
+  int order[n], i, j;
+  for (i = 0; i < n; i++) order[i] = i;
+
+  // sort positions by inode number (n is at most a directory's worth of entries)
+  for (i = 1; i < n; i++) {
+    int k = order[i];
+    for (j = i; j > 0 && index[order[j - 1]] > index[k]; j--) order[j] = order[j - 1];
+    order[j] = k;
+  }
+
+  struct inode table[BLOCK_SIZE / sizeof(struct inode)];
+  int per_block = BLOCK_SIZE / sizeof(struct inode), loaded = -1;
+  int uninit = 0;
+  for (i = 0; i < n; i++) {
+    int block = index[order[i]] / per_block;
+    if (block != loaded) {
+      uninit = (sb.s_flags & SB_ITABLE_UNINIT) && block >= sb.s_itable_init;
+      if (uninit) {
+        memset(table, 0, BLOCK_SIZE);
+      }
+      else {
+        image_seek(START_INODE_ADDR + BLOCK_SIZE * block);
+        image_read(table, BLOCK_SIZE, 1);
+      }
+      loaded = block;
+    }
+    nodes[order[i]] = table[index[order[i]] % per_block];
+    if (uninit == 0) verify_inode(&nodes[order[i]], index[order[i]]);
+  }
+}
+
+/**
+ * Ask the kernel to read the n blocks of BLOCK_SIZE at base + BLOCK_SIZE * blocks[i] into
+ * its page cache in the background, in runs of adjacent blocks. Returns the bytes asked for
+ */
+static uint64_t advise_blocks(uint64_t base, uint32_t *blocks, int n)
+{
+  uint64_t bytes = 0;
+  int i, j;
+
+  for (i = 1; i < n; i++) {
+    uint32_t b = blocks[i];
+    for (j = i; j > 0 && blocks[j - 1] > b; j--) blocks[j] = blocks[j - 1];
+    blocks[j] = b;
+  }
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && blocks[j] <= blocks[j - 1] + 1; j++);
+    uint32_t len = blocks[j - 1] - blocks[i] + 1;
+    posix_fadvise(fileno(fp), base + (uint64_t) BLOCK_SIZE * blocks[i], BLOCK_SIZE * len, POSIX_FADV_WILLNEED);
+    bytes += BLOCK_SIZE * len;
+  }
+
+  return bytes;
+}
+
+/**
+ * Start reading the n inodes at index (and their checksums) into the page cache, without
+ * waiting for them, as read_inodes would read them: a block of the inode table at a time.
+ * Returns the bytes of the image asked for
+ */
+uint64_t prefetch_inodes(uint32_t *index, int n)
+{
+  uint32_t table[n], csum[n];
+  int i, tables = 0;
+
+  for (i = 0; i < n; i++) {
+    uint32_t block = index[i] / INODES_PER_BLOCK;
+    if ((sb.s_flags & SB_ITABLE_UNINIT) && block >= sb.s_itable_init) continue;
+
+    table[tables] = block;
+    csum[tables]  = sb.s_csum_block + index[i] * sizeof(uint32_t) / BLOCK_SIZE;
+    tables++;
+  }
+
+  uint64_t bytes = advise_blocks(START_INODE_ADDR, table, tables);
+  if (sb.s_flags & SB_METADATA_CSUM) bytes += advise_blocks(START_DATA_ADDR, csum, tables);
+
+  return bytes;
 }
 
 /**
@@ -177,8 +924,9 @@ void read_inode(struct inode *node, uint32_t index)
  */
 void read_direntry(struct directory_entry *entries, uint32_t index, int n)
 {
-  fseek(fp, START_DATA_ADDR + BLOCK_SIZE * index, SEEK_SET);
-  fread(entries, BLOCK_SIZE, 1, fp);
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * index);
+  image_read(entries, BLOCK_SIZE, 1);
+  verify_block((char *) entries, index);
 }
 
 /**
@@ -186,8 +934,62 @@ void read_direntry(struct directory_entry *entries, uint32_t index, int n)
  */
 unsigned int read_data(char *data, uint32_t index, int n)
 {
-  fseek(fp, START_DATA_ADDR + BLOCK_SIZE * index, SEEK_SET);
-  return fread(data, 1, n, fp);
+  PROBE2(read_data_entry, index, n);
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * index);
+  unsigned int done = image_read(data, 1, n);
+  PROBE1(read_data_return, done);
+
+  return done;
+}
+
+/**
+ * Map a byte range of the file at inode index onto the disk image. Blocks that follow each
+ * other on disk are merged into one extent, and so are holes, which get e_pos 0.
+ * Returns the number of extents filled
+ */
+int map_extents(struct inode *node, uint32_t index, size_t size, off_t offset, struct extent *ext, int max)
+{
+  int count = 0;
+
+  if (offset >= node->i_size) return 0;
+  if (offset + size > node->i_size) size = node->i_size - offset;
+
+  // inline and tail packed bytes are read and written where they sit
+  if (node->i_flags & (INODE_INLINE | INODE_TAIL)) {
+    if (max == 0) return 0;
+    if (node->i_flags & INODE_INLINE) ext[0].e_pos = START_INODE_ADDR + sizeof(struct inode) * index + offsetof(struct inode, i_block) + offset;
+    else                              ext[0].e_pos = tail_addr(node) + offset;
+    ext[0].e_len   = size;
+    ext[0].e_flags = 0;
+    return 1;
+  }
+
+  while (size > 0 && offset / BLOCK_SIZE < DIRECT_BLOCKS) {
+    uint32_t in    = offset % BLOCK_SIZE;
+    uint32_t len   = (size < BLOCK_SIZE - in) ? size : BLOCK_SIZE - in;
+    uint32_t block = node->i_block[offset / BLOCK_SIZE];
+    uint32_t flags = ((node->i_flags & INODE_COMPRESSED) && cluster_compressed(node, offset / CLUSTER_SIZE)) ? EXTENT_COMPRESSED : 0;
+    uint64_t pos   = (block == BLOCK_HOLE || flags) ? 0 : START_DATA_ADDR + (uint64_t) BLOCK_SIZE * block + in;
+
+    // holes merge with holes, compressed clusters with compressed clusters, and blocks
+    // with the block right after them on disk
+    if (count > 0 && ext[count - 1].e_flags == flags &&
+        (pos == 0 ? ext[count - 1].e_pos == 0 : ext[count - 1].e_pos != 0 && ext[count - 1].e_pos + ext[count - 1].e_len == pos)) {
+      ext[count - 1].e_len += len;
+    }
+    else {
+      if (count == max) break;
+      ext[count].e_pos   = pos;
+      ext[count].e_len   = len;
+      ext[count].e_flags = flags;
+      count++;
+    }
+
+    offset += len;
+    size   -= len;
+  }
+
+  return count;
 }
 
 /**
@@ -195,8 +997,30 @@ unsigned int read_data(char *data, uint32_t index, int n)
  */
 void write_inode(struct inode *node, uint32_t index)
 {
-  fseek(fp, START_INODE_ADDR + sizeof(struct inode) * index, SEEK_SET);
-  fwrite(node, sizeof(struct inode), 1, fp);
+  PROBE1(write_inode_entry, index);
+  if ((sb.s_flags & SB_ITABLE_UNINIT) && index / INODES_PER_BLOCK >= sb.s_itable_init) init_itable(index / INODES_PER_BLOCK);
+
+  image_seek(START_INODE_ADDR + sizeof(struct inode) * index);
+  image_write(node, sizeof(struct inode), 1);
+  csum_inode(node, index);
+  PROBE1(write_inode_return, index);
+}
+
+/**
+ * Zero the uninitialized inode table blocks up to and including block and mark them initialized
+ */
+void init_itable(uint32_t block)
+{
+  char zero[BLOCK_SIZE] = "";
+
+  image_seek(START_INODE_ADDR + BLOCK_SIZE * sb.s_itable_init);
+  for (; sb.s_itable_init <= block; sb.s_itable_init++) image_write(zero, BLOCK_SIZE, 1);
+
+  if (sb.s_itable_init >= ITABLE_BLOCKS) {
+    sb.s_flags      &= ~SB_ITABLE_UNINIT;
+    sb.s_itable_init = 0;
+  }
+  write_superblock();
 }
 
 /**
@@ -206,8 +1030,37 @@ void write_direntry(struct directory_entry *entries, uint32_t index, int n)
 {
   char padding[BLOCK_SIZE] = "";
   memcpy(padding, entries, sizeof(struct directory_entry) * n);
-  fseek(fp, START_DATA_ADDR + BLOCK_SIZE * index, SEEK_SET);
-  fwrite(padding, BLOCK_SIZE, 1, fp);
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * index);
+  image_write(padding, BLOCK_SIZE, 1);
+  csum_block(padding, index);
+}
+
+/**
+ * Write zeros over the bytes from..to of a file, as far as it has blocks (holes are zero already).
+ * A shared block is copied first. Returns -ENOSPC if there is no block to copy it to
+ */
+int zero_range(struct inode *node, uint32_t from, uint32_t to)
+{
+  char zero[BLOCK_SIZE] = "";
+
+  if (to > file_slots(node) * BLOCK_SIZE) to = file_slots(node) * BLOCK_SIZE;
+
+  while (from < to) {
+    uint32_t len = BLOCK_SIZE - from % BLOCK_SIZE;
+    if (len > to - from) len = to - from;
+
+    // a compressed cluster holds zeros past what was compressed into it
+    int packed = (node->i_flags & INODE_COMPRESSED) && cluster_compressed(node, from / CLUSTER_SIZE);
+    if (node->i_block[from / BLOCK_SIZE] != BLOCK_HOLE && packed == 0) {
+      if (unshare_block(node, from / BLOCK_SIZE, 1) < 0) return -ENOSPC;
+      image_seek(START_DATA_ADDR + BLOCK_SIZE * node->i_block[from / BLOCK_SIZE] + from % BLOCK_SIZE);
+      image_write(zero, 1, len);
+      csum_refresh(node->i_block[from / BLOCK_SIZE]);
+    }
+    from += len;
+  }
+
+  return 0;
 }
 
 /**
@@ -216,10 +1069,13 @@ void write_direntry(struct directory_entry *entries, uint32_t index, int n)
 void write_data(char *data, int index, int n)
 {
   char padding[BLOCK_SIZE] = "";
+  PROBE2(write_data_entry, index, n);
   memcpy(padding, data, n);
 
-  fseek(fp, START_DATA_ADDR + BLOCK_SIZE * index, SEEK_SET);
-  fwrite(padding, BLOCK_SIZE, 1, fp);
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * index);
+  image_write(padding, BLOCK_SIZE, 1);
+  if (sb.s_flags & SB_DATA_CSUM) csum_block(padding, index);
+  PROBE1(write_data_return, index);
 }
 
 /**
@@ -228,7 +1084,8 @@ void write_data(char *data, int index, int n)
 int get_inode()
 {
   int temp, count, i = 0;
-  for (; i < 5; i++) {
+  PROBE(get_inode_entry);
+  for (; i < sb.s_inodes_count / 8; i++) {
     if (inode_bm[i] < 255) {
       count = 0;
       temp = inode_bm[i];
@@ -238,19 +1095,37 @@ int get_inode()
       }
       
       inode_bm[i] = (inode_bm[i]) | (1 << count);
+      event(EV_ALLOC_INODE, i + 1, i * 8 + count, 0);
+      PROBE2(get_inode_return, i * 8 + count, i + 1);
       return i * 8 + count;
     }
   } 
   
+  event(EV_ALLOC_INODE, i, -1, 0);
+  PROBE2(get_inode_return, -1, i);
   return -1;
 }
 
 /**
- * Get the index of next free datablock. Each bit determines if datablock is free (bit = 0) or occupied (bit = 1)
+ * Get the index of next free datablock for the new inode at index. If there is none, the inode is released again
  */
 int get_datablock(int index)
+{
+  PROBE1(get_datablock_entry, index);
+  int block = alloc_datablock();
+  if (block == -1) inode_bm[index / 8] &= ~(1 << (index % 8));
+  PROBE1(get_datablock_return, block);
+
+  return block;
+}
+
+/**
+ * Get the index of next free datablock. Each bit determines if datablock is free (bit = 0) or occupied (bit = 1)
+ */
+int alloc_datablock()
 {
   int temp, count, i = 0;
+  PROBE(alloc_datablock_entry);
   for (; i < sb.s_blocks_count / 8; i++) {
     if (block_bm[i] < 255) {
       count = 0;
@@ -261,6 +1136,9 @@ int get_datablock(int index)
       }
       
       block_bm[i] = (block_bm[i]) | (1 << count);
+      dedup_forget(i * 8 + count);
+      event(EV_ALLOC_BLOCK, i + 1, i * 8 + count, 0);
+      PROBE2(alloc_datablock_return, i * 8 + count, i + 1);
       return i * 8 + count;
     }
   }
@@ -276,20 +1154,348 @@ int get_datablock(int index)
     
     if (count < bits) {
       block_bm[i] = (block_bm[i]) | (1 << count);
+      dedup_forget(i * 8 + count);
+      event(EV_ALLOC_BLOCK, i + 1, i * 8 + count, 0);
+      PROBE2(alloc_datablock_return, i * 8 + count, i + 1);
       return i * 8 + count;	
     }
   }
   
-  inode_bm[index / 8] &= ~(1 << (index % 8));
+  event(EV_ALLOC_BLOCK, i, -1, 0);
+  PROBE2(alloc_datablock_return, -1, i);
   return -1;
 }
 
+/**
+ * Get count free datablocks into blocks, taking the first run of count free blocks in a row
+ * so they are contiguous in the image. If there is no such run, any free blocks are taken.
+ * Returns 0, or -1 (with nothing allocated) if there aren't count free blocks
+ */
+int alloc_run(uint32_t *blocks, int count)
+{
+  uint32_t b, start = 0;
+  int i, run = 0;
+
+  for (b = 0; b < sb.s_blocks_count && run < count; b++) {
+    if (block_bm[b / 8] & (1 << (b % 8))) run = 0;
+    else if (run++ == 0) start = b;
+  }
+
+  if (run == count) {
+    for (i = 0; i < count; i++) {
+      blocks[i] = start + i;
+      block_bm[blocks[i] / 8] |= 1 << (blocks[i] % 8);
+      dedup_forget(blocks[i]);
+    }
+    event(EV_ALLOC_RUN, b, start, count);
+    return 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    int block = alloc_datablock();
+    if (block == -1) {
+      while (i-- > 0) block_bm[blocks[i] / 8] &= ~(1 << (blocks[i] % 8));
+      event(EV_ALLOC_RUN, b, -1, count);
+      return -1;
+    }
+    blocks[i] = block;
+  }
+
+  event(EV_ALLOC_RUN, b, blocks[0], count);
+  return 0;
+}
+
+/**
+ * Drop every block a file or directory owns (see free_block), or give back its tail slot.
+ * Returns how many blocks were freed
+ */
+int release_blocks(struct inode *node)
+{
+  int i, freed = 0;
+
+  if (node->i_flags & INODE_TAIL) return tail_free(node->i_block[0], node->i_block[1], node->i_block[2]);
+
+  for (i = 0; i < file_slots(node); i++) {
+    if (node->i_block[i] == BLOCK_HOLE || node->i_block[i] == BLOCK_COMPRESSED) continue;
+    freed += free_block(node->i_block[i]);
+  }
+
+  return freed;
+}
+
+/**
+ * Whether a data block is referenced by more than one block pointer
+ */
+int block_shared(uint32_t block)
+{
+  return block != BLOCK_HOLE && block != BLOCK_COMPRESSED && block_rc[block] > 0;
+}
+
+/**
+ * Write the reference count of one block to its byte of the table
+ */
+void write_refcount(uint32_t block)
+{
+  image_seek(START_DATA_ADDR + BLOCK_SIZE * sb.s_refcount_block + block);
+  image_write(&block_rc[block], 1, 1);
+}
+
+/**
+ * Drop one reference to a data block. It is only cleared in the bitmap once no other block
+ * pointer shares it. Returns 1 if it was freed, 0 if it is still in use
+ */
+int free_block(uint32_t block)
+{
+  if (block_rc[block] > 0) {
+    block_rc[block]--;
+    write_refcount(block);
+    return 0;
+  }
+
+  block_bm[block / 8] &= ~(1 << (block % 8));
+  dedup_forget(block);
+  return 1;
+}
+
+/**
+ * Give slot i of a file a block of its own if its block is shared, so it can be written in
+ * place. With copy the old bytes are copied over. Writes the superblock and bitmaps.
+ * Returns 1 if the block was copied, 0 if it wasn't shared, -ENOSPC if there is no free block
+ */
+int unshare_block(struct inode *node, int i, int copy)
+{
+  if (block_shared(node->i_block[i]) == 0) return 0;
+
+  int block = (sb.s_free_blocks_count > 0) ? alloc_datablock() : -1;
+  if (block == -1) return -ENOSPC;
+
+  char data[BLOCK_SIZE] = "";
+  if (copy) read_data(data, node->i_block[i], BLOCK_SIZE);
+  write_data(data, block, BLOCK_SIZE);
+
+  free_block(node->i_block[i]);
+  node->i_block[i] = block;
+  sb.s_free_blocks_count -= 1;
+  write_superblock();
+  update_bitmaps();
+
+  return 1;
+}
+
+/**
+ * Create the block reference count table: one byte per data block in a contiguous run of
+ * blocks, all zero. Returns 0, or -ENOSPC if there is no such run
+ */
+int init_refcounts()
+{
+  uint32_t run[BLOCK_SIZE * 8 / BLOCK_SIZE], i;
+  uint32_t count = (sb.s_blocks_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if (count > sb.s_free_blocks_count || alloc_run(run, count) == -1) return -ENOSPC;
+  for (i = 1; i < count; i++) {
+    if (run[i] == run[0] + i) continue;
+    for (i = 0; i < count; i++) block_bm[run[i] / 8] &= ~(1 << (run[i] % 8));
+    return -ENOSPC;
+  }
+
+  char zero[1] = "";
+  for (i = 0; i < count; i++) write_data(zero, run[i], 0);
+  memset(block_rc, 0, sizeof(block_rc));
+
+  sb.s_refcount_block     = run[0];
+  sb.s_free_blocks_count -= count;
+  write_superblock();
+  update_bitmaps();
+
+  return 0;
+}
+
+/**
+ * Copy the inode of a file into inode copy for a snapshot. Its blocks gain a reference, a
+ * tail slot is copied to a slot of its own. Returns 1 if that took a new tail block, 0 if not
+ */
+int snapshot_file(uint32_t index, uint32_t copy)
+{
+  struct inode node;
+  int i, taken = 0;
+
+  read_inode(&node, index);
+  node.i_flags |= INODE_SNAPSHOT;
+
+  if (node.i_flags & INODE_TAIL) {
+    char data[BLOCK_SIZE];
+    uint32_t len = node.i_block[2];
+
+    image_seek(tail_addr(&node));
+    image_read(data, 1, len);
+    taken = tail_alloc(len, &node.i_block[0], &node.i_block[1]);
+    image_seek(tail_addr(&node));
+    image_write(data, 1, len);
+    csum_refresh(node.i_block[0]);
+  }
+
+  for (i = 0; i < file_slots(&node); i++) {
+    if (node.i_block[i] == BLOCK_HOLE || node.i_block[i] == BLOCK_COMPRESSED) continue;
+    block_rc[node.i_block[i]]++;
+    write_refcount(node.i_block[i]);
+  }
+
+  write_inode(&node, copy);
+  return taken;
+}
+
+/*
+ * The dedup index maps the hash of a block's bytes to the blocks of files that had them.
+ * It lives in memory only and is built from the inode table the first time it is needed.
+ * Blocks are chained per bucket through dedup_next, indexed by block number. A block leaves
+ * the index when it is freed or allocated again; one that was written in place since it
+ * was hashed is caught by comparing the bytes before sharing it.
+ */
+#define DEDUP_BUCKETS 1024
+
+static int32_t  dedup_head[DEDUP_BUCKETS];
+static int32_t  dedup_next[BLOCK_SIZE * 8];
+static uint32_t dedup_hash[BLOCK_SIZE * 8];
+static unsigned char dedup_in[BLOCK_SIZE * 8];
+static int dedup_ready = 0;
+
+/**
+ * FNV-1a hash of a block's bytes, a word at a time
+ */
+uint32_t block_hash(const char *data)
+{
+  uint32_t hash = 2166136261u, word;
+  int i;
+
+  for (i = 0; i < BLOCK_SIZE; i += sizeof(word)) {
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 16777619u;
+  }
+
+  return hash ^ (hash >> 15);
+}
+
+/**
+ * Add a block with the given hash to the dedup index
+ */
+static void dedup_insert(uint32_t block, uint32_t hash)
+{
+  dedup_hash[block] = hash;
+  dedup_next[block] = dedup_head[hash % DEDUP_BUCKETS];
+  dedup_head[hash % DEDUP_BUCKETS] = block;
+  dedup_in[block]   = 1;
+}
+
+/**
+ * Take a block out of the dedup index, if it is in it
+ */
+void dedup_forget(uint32_t block)
+{
+  if (dedup_ready == 0 || dedup_in[block] == 0) return;
+
+  int32_t *link = &dedup_head[dedup_hash[block] % DEDUP_BUCKETS];
+  while (*link != (int32_t) block) link = &dedup_next[*link];
+  *link = dedup_next[block];
+  dedup_in[block] = 0;
+}
+
+/**
+ * Drop the dedup index, as when another image is opened
+ */
+void dedup_reset()
+{
+  dedup_ready = 0;
+}
+
+/**
+ * Whether slot i of a regular file holds a plain data block that can be shared
+ */
+static int dedup_candidate(struct inode *node, int i)
+{
+  uint32_t block = node->i_block[i];
+
+  if (block == BLOCK_HOLE || block == BLOCK_COMPRESSED) return 0;
+  return (node->i_flags & INODE_COMPRESSED) == 0 || cluster_compressed(node, i / CLUSTER_BLOCKS) == 0;
+}
+
+/**
+ * Build the dedup index from the blocks of every regular file, unless it is there already
+ */
+void dedup_build()
+{
+  struct inode node;
+  char data[BLOCK_SIZE];
+  uint32_t index;
+  int i;
+
+  if (dedup_ready) return;
+  for (i = 0; i < DEDUP_BUCKETS; i++) dedup_head[i] = -1;
+  memset(dedup_in, 0, sizeof(dedup_in));
+  dedup_ready = 1;
+
+  for (index = START_INODE; index < sb.s_inodes_count; index++) {
+    if ((inode_bm[index / 8] & (1 << (index % 8))) == 0) continue;
+    read_inode(&node, index);
+    if (S_ISREG(node.i_mode) == 0 || (node.i_flags & (INODE_INLINE | INODE_TAIL))) continue;
+
+    for (i = 0; i < file_slots(&node); i++) {
+      if (dedup_candidate(&node, i) == 0 || dedup_in[node.i_block[i]]) continue;
+      read_data(data, node.i_block[i], BLOCK_SIZE);
+      if (is_zero(data, BLOCK_SIZE) == 0) dedup_insert(node.i_block[i], block_hash(data));
+    }
+  }
+}
+
+/**
+ * Share slot i of a file with a block of another file (or of this one) that holds the same
+ * bytes, dropping the block it had. Otherwise the block is added to the index.
+ * Blocks of zeros are left alone, so preallocated blocks stay allocated.
+ * Returns 1 if a block was freed, 0 if not
+ */
+int dedup_block(struct inode *node, int i)
+{
+  char data[BLOCK_SIZE], other[BLOCK_SIZE];
+  uint32_t block = node->i_block[i];
+  int32_t c;
+
+  if (dedup_candidate(node, i) == 0) return 0;
+  read_data(data, block, BLOCK_SIZE);
+  if (is_zero(data, BLOCK_SIZE)) return 0;
+
+  uint32_t hash = block_hash(data);
+  for (c = dedup_head[hash % DEDUP_BUCKETS]; c != -1; c = dedup_next[c]) {
+    if (c == (int32_t) block || dedup_hash[c] != hash || block_rc[c] == UINT8_MAX) continue;
+    read_data(other, c, BLOCK_SIZE);
+    if (memcmp(data, other, BLOCK_SIZE) != 0) continue;
+
+    if (sb.s_refcount_block == 0 && init_refcounts() < 0) return 0;
+    block_rc[c]++;
+    write_refcount(c);
+    node->i_block[i] = c;
+    counters.dedup_hits++;
+    return free_block(block);
+  }
+  counters.dedup_misses++;
+
+  // the block may have been written since it was indexed
+  if (dedup_in[block] && dedup_hash[block] != hash) dedup_forget(block);
+  if (dedup_in[block] == 0) dedup_insert(block, hash);
+  return 0;
+}
+
 /**
  * Write the updated bitmaps to the disk
  */
 void update_bitmaps()
 {
-  fseek(fp, BLOCK_SIZE, SEEK_SET);
-  fwrite(block_bm, 1, BLOCK_SIZE, fp);
-  fwrite(inode_bm, 1, BLOCK_SIZE, fp);
+  image_seek(BLOCK_SIZE);
+  image_write(block_bm, 1, BLOCK_SIZE);
+  image_write(inode_bm, 1, BLOCK_SIZE);
+
+  // their checksums live in the superblock
+  if (sb.s_flags & SB_METADATA_CSUM) {
+    sb.s_bitmap_csum[0] = crc32c(0, block_bm, BLOCK_SIZE);
+    sb.s_bitmap_csum[1] = crc32c(0, inode_bm, BLOCK_SIZE);
+    write_superblock();
+  }
 }
@@ -0,0 +1,35 @@
+/*
+ * ioctls understood by files on a simpleFS mount. Include this from tools that
+ * want to use them; they are passed through FUSE to fusefs.c (sfs_ioctl).
+ */
+#include <sys/ioctl.h>
+#include <stdint.h>
+
+/* SFS_IOC_SEEK: lseek(2) SEEK_DATA / SEEK_HOLE for FUSE versions without an lseek hook */
+struct sfs_seek {
+    int64_t offset;   /* in: where to start looking, out: offset found */
+    int32_t whence;   /* SEEK_DATA (3) or SEEK_HOLE (4) */
+    int32_t pad;
+};
+
+#define SFS_IOC_SEEK _IOWR('S', 1, struct sfs_seek)
+
+/* SFS_IOC_DEDUP: share the file's blocks with blocks of any file holding the same bytes */
+#define SFS_IOC_DEDUP _IOR('S', 2, int32_t) /* out: number of blocks freed */
+
+/*
+ * SFS_IOC_CLONE: make dst_offset..dst_offset+length of the file a copy of src_offset.. of
+ * another file on the same mount (or another part of the same file), like FICLONERANGE.
+ * Aligned whole blocks are shared copy-on-write and the rest is copied inside the daemon,
+ * so no data crosses FUSE. The source is named by path because FUSE can't pass a file descriptor.
+ */
+#define SFS_PATH_MAX 256
+
+struct sfs_clone {
+    char    src[SFS_PATH_MAX]; /* in: path of the source from the root of the mount */
+    int64_t src_offset;
+    int64_t dst_offset;
+    int64_t length;            /* in: bytes to clone, 0 for up to the end of the source; out: bytes cloned */
+};
+
+#define SFS_IOC_CLONE _IOWR('S', 3, struct sfs_clone)